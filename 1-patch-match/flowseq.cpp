@@ -0,0 +1,420 @@
+#include "flowseq.hpp"
+#include <fcntl.h>      // open()
+#include <sys/mman.h>   // mmap(), munmap()
+#include <sys/stat.h>   // fstat()
+#include <unistd.h>     // close()
+#include <cstring>
+
+using namespace cv;
+using namespace std;
+
+static const char sequence_magic[4] = { 'P', 'M', 'F', 'S' };
+static const char trailer_magic[8]  = { 'P', 'M', 'F', 'S', 'I', 'N', 'D', 'X' };
+static const uint32_t sequence_version = 1;
+static const uint32_t keyframe_flag = 1;
+
+// rows per independently coded block
+static const int default_block_rows = 16;
+
+static inline uint32_t zigzag(int32_t value)
+{
+    return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t value)
+{
+    return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+static inline void put_varint(vector<uchar>& out, uint32_t value)
+{
+    while (value >= 0x80) {
+        out.push_back((uchar) (value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uchar) value);
+}
+
+static inline uint32_t get_varint(const uchar*& in, const uchar* end)
+{
+    uint32_t value = 0;
+
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (in >= end) {
+            CV_Error(CV_StsParseError, "Truncated flow sequence block");
+        }
+
+        const uchar byte = *in++;
+        value |= (uint32_t) (byte & 0x7F) << shift;
+
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    CV_Error(CV_StsParseError, "Invalid varint in flow sequence block");
+    return 0;
+}
+
+/**
+ * Codes the difference of the current to the base frame for blocks of rows.
+ * If the base is empty, the values themselves are coded.
+ */
+class BlockEncoder : public ParallelLoopBody
+{
+    const Mat& frame;
+    const Mat& base;
+    const int block_rows;
+    vector<vector<uchar>>& blocks;
+
+public:
+    BlockEncoder(const Mat& frame, const Mat& base, int block_rows, vector<vector<uchar>>& blocks) :
+        frame(frame),
+        base(base),
+        block_rows(block_rows),
+        blocks(blocks)
+    {}
+
+    void operator()(const Range& range) const
+    {
+        const int values = frame.cols * 2;
+
+        for (int b = range.start; b < range.end; ++b) {
+            vector<uchar>& out = blocks[b];
+            const int last = min(frame.rows, (b + 1) * block_rows);
+            int zeros = 0;
+
+            out.clear();
+
+            for (int row = b * block_rows; row < last; ++row) {
+                const short* current  = frame.ptr<short>(row);
+                const short* previous = base.empty() ? nullptr : base.ptr<short>(row);
+
+                for (int i = 0; i < values; ++i) {
+                    const int32_t residual = current[i] - (previous != nullptr ? previous[i] : 0);
+
+                    if (residual == 0) {
+                        ++zeros;
+                        continue;
+                    }
+                    if (zeros > 0) {
+                        put_varint(out, 0);
+                        put_varint(out, zeros - 1);
+                        zeros = 0;
+                    }
+                    put_varint(out, zigzag(residual));
+                }
+            }
+
+            if (zeros > 0) {
+                put_varint(out, 0);
+                put_varint(out, zeros - 1);
+            }
+        }
+    }
+};
+
+/**
+ * Inverse of BlockEncoder. The frame holds the base values on entry and is
+ * updated in place.
+ */
+class BlockDecoder : public ParallelLoopBody
+{
+    Mat& frame;
+    const bool delta;
+    const int block_rows;
+    const vector<const uchar*>& blocks;
+    const vector<uint32_t>& sizes;
+
+public:
+    BlockDecoder(Mat& frame, bool delta, int block_rows, const vector<const uchar*>& blocks,
+                 const vector<uint32_t>& sizes) :
+        frame(frame),
+        delta(delta),
+        block_rows(block_rows),
+        blocks(blocks),
+        sizes(sizes)
+    {}
+
+    void operator()(const Range& range) const
+    {
+        for (int b = range.start; b < range.end; ++b) {
+            const uchar* in  = blocks[b];
+            const uchar* end = in + sizes[b];
+
+            const int first = b * block_rows;
+            const int last  = min(frame.rows, first + block_rows);
+
+            // the rows of a block are contiguous in a continuous matrix
+            short* values = frame.ptr<short>(first);
+            const int count = (last - first) * frame.cols * 2;
+
+            for (int i = 0; i < count; ) {
+                const uint32_t token = get_varint(in, end);
+
+                if (token == 0) {
+                    const int zeros = (int) get_varint(in, end) + 1;
+
+                    if (zeros > count - i) {
+                        CV_Error(CV_StsParseError, "Invalid zero run in flow sequence block");
+                    }
+                    if (!delta) {
+                        std::fill(values + i, values + i + zeros, (short) 0);
+                    }
+                    i += zeros;
+                } else {
+                    const int32_t value = unzigzag(token) + (delta ? values[i] : 0);
+                    values[i++] = saturate_cast<short>(value);
+                }
+            }
+        }
+    }
+};
+
+FlowSequenceWriter::FlowSequenceWriter(const string& filename, const Size& size, int fraction_bits,
+                                       int keyframe_interval) :
+    file(filename.c_str(), ios::binary | ios::trunc)
+{
+    CV_Assert(size.width > 0 && size.height > 0);
+    CV_Assert(0 <= fraction_bits && fraction_bits < 15 && keyframe_interval > 0);
+
+    if (!file) {
+        CV_Error(CV_StsError, "Cannot create '" + filename + "'");
+    }
+
+    memcpy(header.magic, sequence_magic, sizeof(header.magic));
+    header.version           = sequence_version;
+    header.width             = size.width;
+    header.height            = size.height;
+    header.fraction_bits     = fraction_bits;
+    header.keyframe_interval = keyframe_interval;
+    header.block_rows        = default_block_rows;
+    header.reserved          = 0;
+
+    file.write((const char*) &header, sizeof(header));
+}
+
+FlowSequenceWriter::~FlowSequenceWriter()
+{
+    close();
+}
+
+void FlowSequenceWriter::append(const Mat& flow)
+{
+    CV_Assert(file.is_open());
+    CV_Assert(flow.type() == CV_32FC2 && flow.cols == header.width && flow.rows == header.height);
+
+    // offsets beyond the 16-bit range are saturated
+    Mat quantized;
+    flow.convertTo(quantized, CV_16S, 1 << header.fraction_bits);
+
+    const bool keyframe = index.size() % header.keyframe_interval == 0;
+    const int nblocks = (header.height + header.block_rows - 1) / header.block_rows;
+    vector<vector<uchar>> blocks(nblocks);
+
+    parallel_for_(Range(0, nblocks), BlockEncoder(quantized, keyframe ? Mat() : previous, header.block_rows, blocks));
+
+    const uint32_t flags = keyframe ? keyframe_flag : 0;
+    const uint32_t count = nblocks;
+
+    index.push_back((uint64_t) file.tellp());
+
+    file.write((const char*) &flags, sizeof(flags));
+    file.write((const char*) &count, sizeof(count));
+
+    for (int b = 0; b < nblocks; ++b) {
+        const uint32_t size = (uint32_t) blocks[b].size();
+        file.write((const char*) &size, sizeof(size));
+    }
+    for (int b = 0; b < nblocks; ++b) {
+        if (!blocks[b].empty()) {
+            file.write((const char*) &blocks[b][0], blocks[b].size());
+        }
+    }
+
+    if (!file) {
+        CV_Error(CV_StsError, "Cannot write flow sequence frame");
+    }
+
+    previous = quantized;
+}
+
+void FlowSequenceWriter::close()
+{
+    if (!file.is_open()) {
+        return;
+    }
+
+    const uint64_t index_offset = (uint64_t) file.tellp();
+    const uint64_t nframes = index.size();
+
+    if (!index.empty()) {
+        file.write((const char*) &index[0], index.size() * sizeof(uint64_t));
+    }
+    file.write((const char*) &index_offset, sizeof(index_offset));
+    file.write((const char*) &nframes, sizeof(nframes));
+    file.write(trailer_magic, sizeof(trailer_magic));
+    file.close();
+}
+
+FlowSequenceReader::FlowSequenceReader(const string& filename) :
+    fd(-1),
+    data(nullptr),
+    length(0),
+    current_frame(-1)
+{
+    fd = ::open(filename.c_str(), O_RDONLY);
+
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        CV_Error(CV_StsError, "Cannot open '" + filename + "'");
+    }
+
+    length = (size_t) info.st_size;
+
+    const size_t trailer_size = 2 * sizeof(uint64_t) + sizeof(trailer_magic);
+
+    if (length >= sizeof(header) + trailer_size) {
+        void* mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        data = mapped == MAP_FAILED ? nullptr : (const uchar*) mapped;
+    }
+
+    if (data == nullptr) {
+        ::close(fd);
+        CV_Error(CV_StsError, "Cannot map '" + filename + "'");
+    }
+
+    memcpy(&header, data, sizeof(header));
+
+    const uchar* trailer = data + length - trailer_size;
+    memcpy(&index_offset, trailer, sizeof(index_offset));
+    memcpy(&nframes, trailer + sizeof(uint64_t), sizeof(nframes));
+
+    // the index must lie between the header and the trailer, written so
+    // that corrupt values cannot overflow
+    bool valid = memcmp(header.magic, sequence_magic, sizeof(sequence_magic)) == 0 &&
+                 header.version == sequence_version &&
+                 header.width > 0 && header.height > 0 && header.block_rows > 0 &&
+                 memcmp(trailer + 2 * sizeof(uint64_t), trailer_magic, sizeof(trailer_magic)) == 0 &&
+                 index_offset >= sizeof(header) && index_offset <= length - trailer_size &&
+                 nframes <= (length - trailer_size - index_offset) / sizeof(uint64_t);
+
+    // every frame record must start after the header and leave room for its
+    // flags and block count before the index
+    for (uint64_t frame = 0; valid && frame < nframes; ++frame) {
+        const uint64_t offset = frame_offset((size_t) frame);
+
+        valid = offset >= sizeof(header) && offset <= index_offset &&
+                index_offset - offset >= 2 * sizeof(uint32_t);
+    }
+
+    if (!valid) {
+        munmap((void*) data, length);
+        ::close(fd);
+        CV_Error(CV_StsParseError, "'" + filename + "' is not a complete flow sequence");
+    }
+
+    current = Mat::zeros(header.height, header.width, CV_16SC2);
+}
+
+FlowSequenceReader::~FlowSequenceReader()
+{
+    munmap((void*) data, length);
+    ::close(fd);
+}
+
+/**
+ * Offset of the frame record. The offsets are checked when the file is
+ * opened.
+ */
+uint64_t FlowSequenceReader::frame_offset(size_t frame) const
+{
+    uint64_t offset;
+    memcpy(&offset, data + index_offset + frame * sizeof(uint64_t), sizeof(offset));
+
+    return offset;
+}
+
+bool FlowSequenceReader::is_keyframe(size_t frame) const
+{
+    uint32_t flags;
+    memcpy(&flags, data + frame_offset(frame), sizeof(flags));
+
+    return (flags & keyframe_flag) != 0;
+}
+
+/**
+ * Decodes the frame on top of the current frame, which must be its
+ * predecessor unless it is a key frame.
+ */
+void FlowSequenceReader::decode(size_t frame)
+{
+    const uchar* record = data + frame_offset(frame);
+    const uchar* end    = data + index_offset;
+
+    uint32_t flags;
+    uint32_t nblocks;
+
+    if (record + 2 * sizeof(uint32_t) > end) {
+        CV_Error(CV_StsParseError, "Truncated flow sequence frame");
+    }
+    memcpy(&flags, record, sizeof(flags));
+    memcpy(&nblocks, record + sizeof(uint32_t), sizeof(nblocks));
+
+    if (nblocks != (uint32_t) ((header.height + header.block_rows - 1) / header.block_rows)) {
+        CV_Error(CV_StsParseError, "Invalid block count in flow sequence frame");
+    }
+
+    vector<uint32_t> sizes(nblocks);
+    vector<const uchar*> blocks(nblocks);
+
+    const uchar* sizes_begin = record + 2 * sizeof(uint32_t);
+    const uchar* block = sizes_begin + nblocks * sizeof(uint32_t);
+
+    if (block > end) {
+        CV_Error(CV_StsParseError, "Truncated flow sequence frame");
+    }
+
+    for (uint32_t b = 0; b < nblocks; ++b) {
+        memcpy(&sizes[b], sizes_begin + b * sizeof(uint32_t), sizeof(uint32_t));
+
+        // compare before advancing, so a huge size cannot overflow the pointer
+        if (sizes[b] > (size_t) (end - block)) {
+            CV_Error(CV_StsParseError, "Truncated flow sequence frame");
+        }
+        blocks[b] = block;
+        block += sizes[b];
+    }
+
+    const bool delta = (flags & keyframe_flag) == 0;
+
+    // If a block fails to decode, the current frame is partly overwritten, so
+    // the next read has to start again from a key frame.
+    current_frame = -1;
+    parallel_for_(Range(0, nblocks), BlockDecoder(current, delta, header.block_rows, blocks, sizes));
+
+    current_frame = frame;
+}
+
+void FlowSequenceReader::read(size_t frame, Mat& flow)
+{
+    CV_Assert(frame < nframes);
+
+    // continue from the current frame if possible, otherwise from the
+    // closest preceding key frame
+    if (current_frame < 0 || (size_t) current_frame != frame) {
+        const size_t first = (current_frame >= 0 && (size_t) current_frame < frame) ? current_frame + 1 : 0;
+        size_t start = frame;
+
+        while (start > first && !is_keyframe(start)) {
+            --start;
+        }
+        for (size_t f = start; f <= frame; ++f) {
+            decode(f);
+        }
+    }
+
+    current.convertTo(flow, CV_32F, 1.0 / (1 << header.fraction_bits));
+}
@@ -0,0 +1,112 @@
+#ifndef CV2_FLOWSEQ_HPP
+#define CV2_FLOWSEQ_HPP
+
+#include "opencv2/opencv.hpp"
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * Container for the flow fields of long image sequences. The file layout is
+ *
+ *   header   FlowSequenceHeader
+ *   frames   one record per frame: uint32 flags, uint32 number of blocks,
+ *            uint32 byte size of each block, followed by the coded blocks
+ *   index    uint64 file offset of each frame record
+ *   trailer  uint64 offset of the index, uint64 number of frames, magic
+ *
+ * The offsets are stored as 16-bit fixed point numbers with the given number
+ * of fraction bits. Between two key frames each frame holds the difference to
+ * the previous one. Each block of rows is coded independently as zigzag
+ * varints in which runs of zeros are replaced by their length.
+ */
+struct FlowSequenceHeader
+{
+    char magic[4];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t fraction_bits;
+    int32_t keyframe_interval;
+    int32_t block_rows;
+    int32_t reserved;
+};
+
+/**
+ * Appends flow fields to a sequence file. Only the previous frame is kept in
+ * memory.
+ */
+class FlowSequenceWriter
+{
+    std::ofstream file;
+    FlowSequenceHeader header;
+
+    // quantized previous frame, base of the difference coding
+    cv::Mat previous;
+
+    // file offsets of the frame records
+    std::vector<uint64_t> index;
+
+public:
+    /**
+     * @param fraction_bits     Precision of the offsets. With 4 bits offsets
+     *                          are stored in steps of 1/16 pixel and must be
+     *                          smaller than 2048 pixels.
+     * @param keyframe_interval Every n-th frame is stored without difference
+     *                          coding. If 1, all frames are key frames.
+     */
+    FlowSequenceWriter(const std::string& filename, const cv::Size& size, int fraction_bits = 4,
+                       int keyframe_interval = 32);
+    ~FlowSequenceWriter();
+
+    /**
+     * Quantizes, codes and writes a CV_32FC2 flow.
+     */
+    void append(const cv::Mat& flow);
+
+    /**
+     * Writes the frame index. No frames can be appended afterwards.
+     */
+    void close();
+
+    size_t size() const { return index.size(); }
+};
+
+/**
+ * Reads frames of a sequence file in any order. The file is memory-mapped.
+ * Sequential reads decode only one frame each, random access starts at the
+ * closest preceding key frame.
+ */
+class FlowSequenceReader
+{
+    int fd;
+    const uchar* data;
+    size_t length;
+
+    FlowSequenceHeader header;
+    uint64_t index_offset;
+    uint64_t nframes;
+
+    // quantized frame that was decoded last
+    cv::Mat current;
+    int64_t current_frame;
+
+    uint64_t frame_offset(size_t frame) const;
+    bool is_keyframe(size_t frame) const;
+    void decode(size_t frame);
+
+public:
+    FlowSequenceReader(const std::string& filename);
+    ~FlowSequenceReader();
+
+    size_t size() const { return (size_t) nframes; }
+    cv::Size frame_size() const { return cv::Size(header.width, header.height); }
+
+    /**
+     * Returns the flow of the given frame as CV_32FC2.
+     */
+    void read(size_t frame, cv::Mat& flow);
+};
+
+#endif //CV2_FLOWSEQ_HPP
@@ -1,7 +1,11 @@
 #include <getopt.h>     // getopt_long()
 #include <time.h>       // time
 #include <stdlib.h>     // srand, rand
+#include <stdio.h>      // sscanf
 #include "patchmatch.hpp"
+#include "tiled.hpp"
+#include "flowseq.hpp"
+#include <fstream>
 #include <iostream>
 
 using namespace cv;
@@ -14,6 +18,15 @@ static int   search_radius = -1;
 static int   iterations    =  4;
 static int   pyramid       =  3;
 static float search_ratio  = 0.5;
+static const char* mask_file = nullptr;
+static double budget       =  0;
+static bool  descriptors   = false;
+static bool  packed        = false;
+static Size  tiled;
+static int   memory        = 512;
+static const char* output_file = nullptr;
+static const char* stats_file = nullptr;
+static const char* sequence_file = nullptr;
 
 // command line option list
 static const struct option long_options[] = {
@@ -24,12 +37,22 @@ static const struct option long_options[] = {
     { "pyramid",        required_argument, 0, 'p' },
     { "match-radius",   required_argument, 0, 'r' },
     { "search-ratio",   required_argument, 0, 'w' },
+    { "mask",           required_argument, 0, 'k' },
+    { "budget",         required_argument, 0, 'b' },
+    { "descriptors",    no_argument,       0, 'd' },
+    { "packed",         no_argument,       0, 'P' },
+    { "tiled",          required_argument, 0, 't' },
+    { "memory",         required_argument, 0, 'M' },
+    { "output",         required_argument, 0, 'o' },
+    { "stats",          required_argument, 0, 'S' },
+    { "output-sequence", required_argument, 0, 'O' },
     0 // end of parameter list
 };
 
 static void usage()
 {
     cout << "Usage: patchmatch [options] image1 image2" << endl;
+    cout << "       patchmatch [options] --output-sequence file image1 image2 ... imageN" << endl;
     cout << "  options:" << endl;
     cout << "    -h, --help            Show this help message" << endl;
     cout << "    -m, --maxoffset       Maximal offset in x and y direction for each" << endl;
@@ -44,6 +67,26 @@ static void usage()
     cout << "    -w, --search-ratio    Fraction that will contract the search window in" << endl;
     cout << "                          each iteration step. This float must be in the" << endl;
     cout << "                          interval (0,1). Default: " << search_ratio << endl;
+    cout << "    -k, --mask            Image file. The flow is only computed for pixels" << endl;
+    cout << "                          that are non-zero in this mask." << endl;
+    cout << "    -b, --budget          Time budget in seconds. If it runs out, the best" << endl;
+    cout << "                          flow found so far is used. Default: unlimited" << endl;
+    cout << "    -d, --descriptors     Reject candidates by projected patch descriptors" << endl;
+    cout << "                          before the exact SSD is calculated." << endl;
+    cout << "    -P, --packed          Store the offsets as 16-bit integers during the" << endl;
+    cout << "                          search to save memory bandwidth." << endl;
+    cout << "    -t, --tiled WxH       Process the images tile by tile. image1 and image2" << endl;
+    cout << "                          are raw 8-bit grayscale files of this size." << endl;
+    cout << "                          Cannot be combined with --mask, --budget," << endl;
+    cout << "                          --stats or --output-sequence." << endl;
+    cout << "    -M, --memory          Memory budget in MiB for the tiled mode." << endl;
+    cout << "                          Default: " << memory << endl;
+    cout << "    -o, --output          Output file for the tiled mode. The flow is" << endl;
+    cout << "                          written as raw 32-bit float pairs." << endl;
+    cout << "    -S, --stats           Write search statistics as JSON into this file." << endl;
+    cout << "                          Requires a build with PATCHMATCH_STATS." << endl;
+    cout << "    -O, --output-sequence Compute the flow between each pair of consecutive" << endl;
+    cout << "                          images and append it to this flow sequence file." << endl;
 }
 
 static bool parsePositionalImage(Mat& image, const int channels, const string& name, int argc, char const *argv[])
@@ -66,6 +109,58 @@ static bool parsePositionalImage(Mat& image, const int channels, const string& n
     return true;
 }
 
+/**
+ * Streams the flow of all consecutive image pairs into the sequence file.
+ * Only the current pair of images is kept in memory.
+ */
+static int matchSequence(int argc, char const *argv[])
+{
+    Mat previous;
+    Mat current;
+    Mat flow;
+
+    if (argc - optind < 2) {
+        cerr << argv[0] << ": at least two images are required" << endl;
+        usage();
+        return 1;
+    }
+
+    if (!parsePositionalImage(previous, CV_LOAD_IMAGE_GRAYSCALE, "frame1", argc, argv)) { return 1; }
+
+    PatchMatch pm(maxoffset, match_radius, iterations, pyramid, search_ratio, search_radius);
+    pm.set_budget(budget);
+    pm.set_descriptors(descriptors);
+    pm.set_packed(packed);
+    pm.set_snapshots(false);
+
+    try {
+        FlowSequenceWriter writer(sequence_file, previous.size());
+
+        while (optind < argc) {
+            if (!parsePositionalImage(current, CV_LOAD_IMAGE_GRAYSCALE, "frame", argc, argv)) { return 1; }
+
+            if (current.size() != previous.size()) {
+                cerr << "Images must be of same dimensions" << endl;
+                return 1;
+            }
+
+            pm.match(previous, current, flow);
+            writer.append(flow);
+
+            cout << "Frame " << writer.size() << " of " << (argc - optind + writer.size()) << endl;
+
+            previous = current;
+            current = Mat();
+        }
+        writer.close();
+    } catch (const cv::Exception& e) {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
+
 int main(int argc, const char* argv[])
 {
     // initialize random seed
@@ -73,6 +168,7 @@ int main(int argc, const char* argv[])
 
     Mat image1;
     Mat image2;
+    Mat mask;
     Mat flow;
     Mat rgb;
 
@@ -81,7 +177,7 @@ int main(int argc, const char* argv[])
     while (true) {
         int index = -1;
 
-        int result = getopt_long(argc, (char **) argv, "hr:t:d:m:g:c:l:", long_options, &index);
+        int result = getopt_long(argc, (char **) argv, "hm:s:i:p:r:w:k:b:dPt:M:o:S:O:", long_options, &index);
 
         // end of parameter list
         if (result == -1) {
@@ -141,6 +237,54 @@ int main(int argc, const char* argv[])
                 }
                 break;
 
+            case 'k':
+                mask_file = optarg;
+                break;
+
+            case 'b':
+                budget = stod(string(optarg));
+                if (budget < 0) {
+                    cerr << argv[0] << ": Invalid time budget " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            case 'd':
+                descriptors = true;
+                break;
+
+            case 'P':
+                packed = true;
+                break;
+
+            case 't':
+                if (sscanf(optarg, "%dx%d", &tiled.width, &tiled.height) != 2 ||
+                    tiled.width <= 0 || tiled.height <= 0) {
+                    cerr << argv[0] << ": Invalid image size " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            case 'M':
+                memory = stoi(string(optarg));
+                if (memory <= 0) {
+                    cerr << argv[0] << ": Invalid memory budget " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            case 'o':
+                output_file = optarg;
+                break;
+
+            case 'S':
+                stats_file = optarg;
+                break;
+
+            case 'O':
+                sequence_file = optarg;
+                break;
+
             case '?': // missing option
                 return 1;
 
@@ -150,6 +294,41 @@ int main(int argc, const char* argv[])
         }
     }
 
+    if (tiled.area() > 0) {
+        if (optind + 2 > argc) {
+            cerr << argv[0] << ": required arguments: 'frame1' 'frame2'" << endl;
+            usage();
+            return 1;
+        }
+        if (output_file == nullptr) {
+            cerr << argv[0] << ": --output is required in the tiled mode" << endl;
+            return 1;
+        }
+        if (budget > 0 || stats_file != nullptr || sequence_file != nullptr || mask_file != nullptr) {
+            cerr << argv[0] << ": --budget, --stats, --output-sequence and --mask "
+                 << "are not supported in the tiled mode" << endl;
+            return 1;
+        }
+
+        TiledPatchMatch tpm(maxoffset, match_radius, iterations, pyramid, search_ratio, search_radius,
+                            (size_t) memory << 20);
+        tpm.get_matcher().set_descriptors(descriptors);
+        tpm.get_matcher().set_packed(packed);
+
+        try {
+            tpm.match(argv[optind], argv[optind + 1], tiled, output_file);
+        } catch (const cv::Exception& e) {
+            cerr << "Error: " << e.what() << endl;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (sequence_file != nullptr) {
+        return matchSequence(argc, argv);
+    }
+
     if (!parsePositionalImage(image1, CV_LOAD_IMAGE_GRAYSCALE, "frame1", argc, argv)) { return 1; }
     if (!parsePositionalImage(image2, CV_LOAD_IMAGE_GRAYSCALE, "frame2", argc, argv)) { return 1; }
 
@@ -158,6 +337,19 @@ int main(int argc, const char* argv[])
         return 1;
     }
 
+    if (mask_file != nullptr) {
+        mask = imread(mask_file, CV_LOAD_IMAGE_GRAYSCALE);
+
+        if (mask.empty()) {
+            cerr << "Error: Cannot read '" << mask_file << "'" << endl;
+            return 1;
+        }
+        if (mask.size() != image1.size()) {
+            cerr << "Mask must be of same dimensions as the images" << endl;
+            return 1;
+        }
+    }
+
     cout << "Parameters:" << endl;
     cout << "  iterations:     " << iterations << endl;
     cout << "  pyramid levels: " << pyramid << endl;
@@ -169,9 +361,34 @@ int main(int argc, const char* argv[])
 
     // create matcher object
     PatchMatch pm(maxoffset, match_radius, iterations, pyramid, search_ratio, search_radius);
+    pm.set_budget(budget);
+    pm.set_descriptors(descriptors);
+    pm.set_packed(packed);
 
     // use matcher to calculate optical flow
-    pm.match(image1, image2, flow);
+    if (mask.empty()) {
+        pm.match(image1, image2, flow);
+    } else {
+        pm.match(image1, image2, mask, flow);
+    }
+
+    if (!pm.get_progress().complete) {
+        cout << "Time budget exceeded in pyramid level " << pm.get_progress().level
+             << " after " << pm.get_progress().iteration << " iterations" << endl;
+    }
+
+    if (stats_file != nullptr) {
+        #ifndef PATCHMATCH_STATS
+            cerr << "Warning: patchmatch was built without PATCHMATCH_STATS, all counters are zero" << endl;
+        #endif
+        ofstream out(stats_file);
+
+        if (!out) {
+            cerr << "Error: Cannot write '" << stats_file << "'" << endl;
+            return 1;
+        }
+        pm.get_statistics().write(out);
+    }
 
     // calculate RGB image from the optiocal flow offsets
     flow2rgb(flow, rgb);
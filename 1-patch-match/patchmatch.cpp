@@ -45,48 +45,264 @@ float ssd(const Mat& image1, const Point2i& center1, const Mat& image2, const Po
     return sum;
 }
 
+int ssd_batch(const Mat& image1, const Point2i& center1, const Mat& image2, const Point2i* centers2,
+              const int count, const int radius, const float halt, float* costs)
+{
+    int halted = 0;
+
+    for (int first = 0; first < count; first += 4) {
+        const int n = min(4, count - first);
+        const uchar* rows2[4];
+
+        #if CV_SSE2
+            const __m128 halt4 = _mm_set1_ps(halt);
+            __m128 sum4 = _mm_setzero_ps();
+        #else
+            float sum4[4] = { 0, 0, 0, 0 };
+        #endif
 
-void flow2rgb(const Mat& flow, Mat& rgb)
+        for (int row = -radius; row <= radius; ++row) {
+            const uchar* row1 = image1.ptr<uchar>(row + center1.y) + center1.x;
+
+            // unused lanes repeat the last candidate
+            for (int k = 0; k < 4; ++k) {
+                const Point2i& center2 = centers2[first + min(k, n - 1)];
+                rows2[k] = image2.ptr<uchar>(row + center2.y) + center2.x;
+            }
+
+            for (int col = -radius; col <= radius; ++col) {
+                #if CV_SSE2
+                    const __m128 gray1 = _mm_set1_ps(row1[col]);
+                    const __m128 gray2 = _mm_setr_ps(rows2[0][col], rows2[1][col], rows2[2][col], rows2[3][col]);
+                    const __m128 diff  = _mm_sub_ps(gray1, gray2);
+
+                    sum4 = _mm_add_ps(sum4, _mm_mul_ps(diff, diff));
+                #else
+                    for (int k = 0; k < 4; ++k) {
+                        const float diff = row1[col] - rows2[k][col];
+                        sum4[k] += diff * diff;
+                    }
+                #endif
+            }
+
+            // early termination, if all candidates of this group lost
+            #if CV_SSE2
+                if (_mm_movemask_ps(_mm_cmpgt_ps(sum4, halt4)) == 0xF) {
+                    halted += row < radius;
+                    break;
+                }
+            #else
+                if (sum4[0] > halt && sum4[1] > halt && sum4[2] > halt && sum4[3] > halt) {
+                    halted += row < radius;
+                    break;
+                }
+            #endif
+        }
+
+        #if CV_SSE2
+            float sums[4];
+            _mm_storeu_ps(sums, sum4);
+        #else
+            const float* sums = sum4;
+        #endif
+
+        for (int k = 0; k < n; ++k) {
+            costs[first + k] = sums[k];
+        }
+    }
+
+    return halted;
+}
+
+void project_patches(const Mat& image, const int radius, Mat& descriptors)
 {
-    // extract x and y channels
-    Mat xy[2]; // x,y
+    CV_Assert(image.type() == CV_8UC1);
+
+    Mat sums;
+    integral(image, sums, CV_64F);
+
+    descriptors = Mat::zeros(image.size(), CV_32FC4);
+
+    // sum over the rectangle [x0, x1) x [y0, y1)
+    auto area = [&sums] (int x0, int y0, int x1, int y1) {
+        return sums.at<double>(y1, x1) - sums.at<double>(y0, x1) - sums.at<double>(y1, x0) + sums.at<double>(y0, x0);
+    };
+
+    // Normalization factors of the basis. The 1D functions are the constant
+    // function and a step function that is +1 on the first half, -1 on the
+    // second half and 0 on the center pixel.
+    const int size = 2 * radius + 1;
+    const double constant = 1.0 / size;
+    const double step = radius > 0 ? 1.0 / sqrt(2.0 * radius * size) : 0;
+    const double diagonal = radius > 0 ? 1.0 / (2.0 * radius) : 0;
+
+    for (int row = radius; row < image.rows - radius; ++row) {
+        Vec4f* desc = descriptors.ptr<Vec4f>(row);
+
+        for (int col = radius; col < image.cols - radius; ++col) {
+            const int x0 = col - radius, x1 = col + radius + 1;
+            const int y0 = row - radius, y1 = row + radius + 1;
+
+            const double all    = area(x0, y0, x1, y1);
+            const double left   = area(x0, y0, col, y1);
+            const double right  = area(col + 1, y0, x1, y1);
+            const double top    = area(x0, y0, x1, row);
+            const double bottom = area(x0, row + 1, x1, y1);
+            const double diag   = area(x0, y0, col, row) + area(col + 1, row + 1, x1, y1)
+                                - area(col + 1, y0, x1, row) - area(x0, row + 1, col, y1);
+
+            desc[col] = Vec4f(all * constant, (left - right) * step, (top - bottom) * step, diag * diagonal);
+        }
+    }
+}
 
-    split(flow, xy);
+// number of bins of the color wheel lookup table over the flow angle
+static const int wheel_bins = 1024;
+
+/**
+ * Builds the color wheel of the Middlebury flow benchmark (Baker et al.). It
+ * consists of 55 hues: red-yellow, yellow-green, green-cyan, cyan-blue,
+ * blue-magenta and magenta-red with 15, 6, 4, 11, 13 and 6 steps. The table
+ * interpolates the wheel at wheel_bins angles in [0, 360) degrees and stores
+ * BGR colors in [0, 1].
+ */
+static vector<Vec3f> make_color_wheel()
+{
+    const int steps[6] = { 15, 6, 4, 11, 13, 6 };
+    vector<Vec3f> wheel;
+
+    for (int segment = 0; segment < 6; ++segment) {
+        for (int i = 0; i < steps[segment]; ++i) {
+            const float rising  = (float) i / steps[segment];
+            const float falling = 1 - rising;
+            Vec3f color;  // RGB
+
+            switch (segment) {
+                case 0: color = Vec3f(1, rising, 0);  break;
+                case 1: color = Vec3f(falling, 1, 0); break;
+                case 2: color = Vec3f(0, 1, rising);  break;
+                case 3: color = Vec3f(0, falling, 1); break;
+                case 4: color = Vec3f(rising, 0, 1);  break;
+                case 5: color = Vec3f(1, 0, falling); break;
+            }
+            wheel.push_back(Vec3f(color[2], color[1], color[0]));
+        }
+    }
+
+    const int ncolors = (int) wheel.size();
+    vector<Vec3f> table(wheel_bins);
+
+    for (int bin = 0; bin < wheel_bins; ++bin) {
+        const float position = (float) bin / wheel_bins * (ncolors - 1);
+        const int k0 = (int) position;
+        const int k1 = (k0 + 1) % ncolors;
+        const float f = position - k0;
+
+        table[bin] = wheel[k0] * (1 - f) + wheel[k1] * f;
+    }
+
+    return table;
+}
 
-    // calculate angle and magnitude for the HSV color wheel
-    Mat magnitude;
-    Mat angle;
+/**
+ * Colors the rows of a flow field. The hue encodes the direction and the
+ * saturation the magnitude relative to the normalization magnitude. Larger
+ * offsets are darkened.
+ */
+class FlowColoring : public ParallelLoopBody
+{
+    const Mat& flow;
+    Mat& rgb;
+    const float scale;
+    const vector<Vec3f>& wheel;
+
+public:
+    FlowColoring(const Mat& flow, Mat& rgb, float max_magnitude, const vector<Vec3f>& wheel) :
+        flow(flow),
+        rgb(rgb),
+        scale(1.0f / max_magnitude),
+        wheel(wheel)
+    {}
+
+    void operator()(const Range& rows) const
+    {
+        const float bins_per_degree = wheel_bins / 360.0f;
+
+        for (int row = rows.start; row < rows.end; ++row) {
+            const Vec2f* offsets = flow.ptr<Vec2f>(row);
+            Vec3b* colors = rgb.ptr<Vec3b>(row);
+
+            for (int col = 0; col < flow.cols; ++col) {
+                const float u = offsets[col][0];
+                const float v = offsets[col][1];
+                const float radius = sqrt(u * u + v * v) * scale;
+
+                // fastAtan2() returns degrees in [0, 360), which is the wheel
+                // position of the flow direction
+                const int bin = min(wheel_bins - 1, (int) (fastAtan2(v, u) * bins_per_degree));
+                const Vec3f& hue = wheel[bin];
+
+                for (int c = 0; c < 3; ++c) {
+                    const float value = radius <= 1 ? 1 - radius * (1 - hue[c]) : hue[c] * 0.75f;
+                    colors[col][c] = (uchar) (255 * value);
+                }
+            }
+        }
+    }
+};
 
-    cartToPolar(xy[0], xy[1], magnitude, angle, true);
+void flow2rgb(const Mat& flow, Mat& rgb, float max_magnitude)
+{
+    CV_Assert(flow.type() == CV_32FC2);
 
-    // translate magnitude to range [0,1]
-    double mag_max;
-    minMaxLoc(magnitude, 0, &mag_max);
+    static const vector<Vec3f> wheel = make_color_wheel();
 
-    magnitude.convertTo(
-        magnitude,    // output matrix
-        -1,           // type of the ouput matrix, if negative same type as input matrix
-        1.0 / mag_max // scaling factor
-    );
+    // without a fixed normalization the largest offset of this flow is used
+    if (max_magnitude <= 0) {
+        float max_squared = 0;
 
-    // build HSV image (hue-saturation-value)
-    Mat _hsv[3]; // array of three matrices - one for each channel
-    Mat hsv;
+        for (int row = 0; row < flow.rows; ++row) {
+            const Vec2f* offsets = flow.ptr<Vec2f>(row);
 
-    // create separate channels
-    _hsv[0] = angle;                           // H (hue)              [0,360]
-    _hsv[1] = magnitude;                       // S (saturation)       [0,1]
-    _hsv[2] = Mat::ones(angle.size(), CV_32F); // V (brigthness value) [0,1]
+            for (int col = 0; col < flow.cols; ++col) {
+                max_squared = max(max_squared, offsets[col].dot(offsets[col]));
+            }
+        }
+        max_magnitude = max_squared > 0 ? sqrt(max_squared) : 1;
+    }
 
-    // merge the three components to a three channel HSV image
-    merge(_hsv, 3, hsv);
+    rgb.create(flow.size(), CV_8UC3);
 
-    // convert to BGR
-    cvtColor(hsv, rgb, cv::COLOR_HSV2BGR);
+    parallel_for_(Range(0, flow.rows), FlowColoring(flow, rgb, max_magnitude, wheel));
 }
 
 
 
+/**
+ * Arithmetic of the offsets in the nearest-neighbor field. Float offsets are
+ * rounded to the nearest pixel when they are used, packed offsets are integers
+ * from the start.
+ */
+template <typename T> struct Offsets;
+
+template <> struct Offsets<float>
+{
+    typedef Point2f Index;
+
+    static const int type = CV_32FC2;
+
+    static inline Point2f pack(const Point2f& offset, const Point2i&) { return offset; }
+};
+
+template <> struct Offsets<short>
+{
+    typedef Point2i Index;
+
+    static const int type = CV_16SC2;
+
+    static inline Point_<short> pack(const Point2f&, const Point2i& pixels) { return Point_<short>(pixels.x, pixels.y); }
+};
+
 PatchMatch::PatchMatch(int maxoffset, int match_radius, int iterations, int pyramid,
                        float search_ratio, int search_radius) :
     // Parameters
@@ -97,12 +313,76 @@ PatchMatch::PatchMatch(int maxoffset, int match_radius, int iterations, int pyra
     search_ratio(search_ratio),
     border(match_radius),
     max_search_radius(search_radius == -1),
-    search_radius(search_radius)
+    search_radius(search_radius),
+    budget(0),
+    cancel(nullptr),
+    use_descriptors(false),
+    packed(false),
+    snapshots(true)
 {
-    // do nothing
+    stats.clear();
+}
+
+void PatchMatch::set_budget(double seconds)
+{
+    budget = seconds;
+}
+
+void PatchMatch::set_cancel(const atomic<bool>* token)
+{
+    cancel = token;
+}
+
+void PatchMatch::set_descriptors(bool enabled)
+{
+    use_descriptors = enabled;
+}
+
+void PatchMatch::set_packed(bool enabled)
+{
+    CV_Assert(!enabled || maxoffset <= numeric_limits<short>::max());
+
+    packed = enabled;
+}
+
+void PatchMatch::set_snapshots(bool enabled)
+{
+    snapshots = enabled;
 }
 
 void PatchMatch::match(const Mat& image1, const Mat& image2, Mat& dest)
+{
+    run(image1, image2, Mat(), dest);
+}
+
+void PatchMatch::match(const Mat& image1, const Mat& image2, const Mat& mask, Mat& dest)
+{
+    CV_Assert(mask.type() == CV_8UC1 && mask.size() == image1.size());
+
+    run(image1, image2, mask, dest);
+
+    // the offsets outside of the requested region are only by-products of
+    // the propagation
+    Mat result = Mat::zeros(dest.size(), dest.type());
+    dest.copyTo(result, mask);
+    dest = result;
+}
+
+void PatchMatch::match(const Mat& image1, const Mat& image2, const vector<Point2i>& points, Mat& dest)
+{
+    Mat mask = Mat::zeros(image1.size(), CV_8UC1);
+    const Rect bounds(Point(), image1.size());
+
+    for (size_t i = 0; i < points.size(); ++i) {
+        CV_Assert(bounds.contains(points[i]));
+
+        mask.at<uchar>(points[i]) = 255;
+    }
+
+    match(image1, image2, mask, dest);
+}
+
+void PatchMatch::run(const Mat& image1, const Mat& image2, const Mat& mask, Mat& dest)
 {
     vector<tuple<Mat, Mat>> levels(pyramid);
     levels[0] = tuple<Mat, Mat>(image1, image2);
@@ -116,6 +396,55 @@ void PatchMatch::match(const Mat& image1, const Mat& image2, Mat& dest)
         levels[p] = level;
     }
 
+    // Region of each pyramid level that has to be searched. Each iteration
+    // reads the offsets of the direct neighbors. The region is grown by one
+    // pixel per iteration, so that good offsets from the surrounding pixels
+    // can reach the requested ones. This only approximates a dense search:
+    // within one scanline sweep an offset can travel arbitrarily far. An
+    // empty mask searches the whole image.
+    vector<Mat> masks(pyramid);
+
+    if (!mask.empty()) {
+        const Mat kernel = getStructuringElement(MORPH_RECT, Size(2 * iterations + 1, 2 * iterations + 1));
+
+        dilate(mask, masks[0], kernel);
+
+        for (int p = 1; p < pyramid; ++p) {
+            // area interpolation keeps single pixels alive in the coarser level
+            resize(masks[p - 1], masks[p], get<0>(levels[p]).size(), 0, 0, INTER_AREA);
+            dilate(masks[p] > 0, masks[p], kernel);
+        }
+    }
+
+    // number of searched pixels in each level for the budget scheduler
+    vector<double> areas(pyramid);
+
+    for (int p = 0; p < pyramid; ++p) {
+        const Mat& frame = get<0>(levels[p]);
+
+        if (masks[p].empty()) {
+            areas[p] = max(0, frame.rows - 2 * border) * max(0, frame.cols - 2 * border);
+        } else {
+            areas[p] = countNonZero(masks[p]);
+        }
+    }
+
+    if (level_costs.size() != (size_t) pyramid) {
+        level_costs.assign(pyramid, 0);
+    }
+
+    if (budget > 0) {
+        deadline = getTickCount() + (int64) (budget * getTickFrequency());
+    } else {
+        deadline = numeric_limits<int64>::max();
+    }
+
+    progress.level = pyramid - 1;
+    progress.iteration = 0;
+    progress.complete = true;
+
+    stats.clear();
+
     // walk backwards through the pyramid levels
     for (int p = pyramid - 1; p >= 0; --p) {
         #ifndef NDEBUG
@@ -129,6 +458,13 @@ void PatchMatch::match(const Mat& image1, const Mat& image2, Mat& dest)
         nrows = frame1.rows;
         ncols = frame2.cols;
 
+        update_spans(masks[p]);
+
+        if (use_descriptors) {
+            project_patches(frame1, match_radius, descriptors1);
+            project_patches(frame2, match_radius, descriptors2);
+        }
+
         // TODO: Maybe we should adapt the maxoffset to the pyramid level?
 
         // if the initial search radius was set to "-1" we use
@@ -137,14 +473,42 @@ void PatchMatch::match(const Mat& image1, const Mat& image2, Mat& dest)
             search_radius = min(nrows, ncols);
         }
 
+        // The window of the random search shrinks by the search ratio in each
+        // step until it is smaller than one pixel. It is the same for all pixels.
+        radii.clear();
+        for (int i = 0; ; ++i) {
+            const float distance = search_radius * pow(search_ratio, i);
+
+            if (distance < 1) {
+                break;
+            }
+            radii.push_back(distance);
+        }
+        candidates.resize(radii.size());
+        centers.resize(radii.size());
+        scores.resize(radii.size());
+        scales.resize(radii.size());
+
+        PM_STAT(
+            if (stats.random_tried.size() < radii.size()) {
+                stats.random_tried.resize(radii.size(), 0);
+                stats.random_accepted.resize(radii.size(), 0);
+            }
+        )
+
         // the very first iteration, we have to initialize the offsets randomly
         if (p == pyramid - 1) {
             // create an empty matrix with the same x-y dimensions like the first
             // image but with two channels. Each channel stands for an x/y offset
             // of a pixel at this position.
-            flow = Mat::zeros(nrows, ncols, CV_32FC2); // 2-channel 32-bit floating point
+            // 2-channel 32-bit floating point or 16-bit integer if packed
+            flow = Mat::zeros(nrows, ncols, packed ? Offsets<short>::type : Offsets<float>::type);
 
-            initialize(frame1, frame2);
+            if (packed) {
+                initialize<short>(frame1, frame2);
+            } else {
+                initialize<float>(frame1, frame2);
+            }
         }
         // in the lower pyramid levels, we can use the prior knowledge and scale the
         // offset matrix up
@@ -154,45 +518,218 @@ void PatchMatch::match(const Mat& image1, const Mat& image2, Mat& dest)
             flow = resized;
         }
 
-        Mat rgb;
-        flow2rgb(flow, rgb);
-        // if we do not convert it, be got black images
-        // in the PNG files
-        rgb.convertTo(rgb, CV_8UC3, 255.0); 
-        imwrite("flow-p" + to_string(p) + "-init.png", rgb);
+        snapshot("flow-p" + to_string(p) + "-init.png");
+
+        // if the budget or the search was cancelled in a coarser level, the
+        // flow is only scaled up to the full resolution
+        if (!progress.complete) {
+            continue;
+        }
+
+        const int64 level_start = getTickCount();
+        level_deadline = schedule(p, areas);
+        progress.level = p;
 
         for (niterations = 0; niterations < iterations; ++niterations) {
             #ifndef NDEBUG
                 cerr << "iteration " << (niterations + 1) << endl;
             #endif
-            // for (int row = match_radius; row < nrows - match_radius; ++row) {
-            for (int row = border; row < nrows - border ; ++row) {
-                #ifndef NDEBUG
-                    cerr << "\r" << row;
-                #endif
-                for (int col = border; col < ncols - border; ++col) {
-                    // if (p == 1) cerr << "propagate" << endl;
-                    float cost = propagate(frame1, frame2, row, col);
-                    // if (p == 1) cerr << "random search" << endl;
-                    random_search(frame1, frame2, row, col, cost);
-                }
+            PM_STAT(
+                const Statistics::Iteration record = { p, niterations, 0, 0 };
+                stats.iterations.push_back(record);
+            )
+
+            if (packed) {
+                sweep<short>(frame1, frame2);
+            } else {
+                sweep<float>(frame1, frame2);
             }
-            #ifndef NDEBUG
-                cerr << "\r";
-            #endif
 
             // display result
-            Mat rgb;
-            flow2rgb(flow, rgb);
-            // if we do not convert it, be got black images
-            // in the PNG files
-            rgb.convertTo(rgb, CV_8UC3, 255.0); 
-            imwrite("flow-p" + to_string(p) + "-i" + to_string(niterations) + ".png", rgb);
+            snapshot("flow-p" + to_string(p) + "-i" + to_string(niterations) + ".png");
+
+            if (interrupted()) {
+                break;
+            }
+        }
+
+        // only finished iterations count as progress, a partial sweep
+        // nevertheless improved the flow
+        progress.iteration = niterations;
+
+        // remember the costs of this level for the next scheduling. If not
+        // even the first iteration finished, the swept part is unknown and
+        // the previous estimate is kept.
+        const double elapsed = (getTickCount() - level_start) / getTickFrequency();
+        const double work = areas[p] * progress.iteration;
+
+        if (work > 0) {
+            level_costs[p] = elapsed / work;
+        }
+
+        #ifndef NDEBUG
+            cerr << "level " << p << " took " << elapsed << "s" << endl;
+        #endif
+    }
+    flow.convertTo(dest, CV_32F);
+}
+
+/**
+ * Writes the current flow as color image
+ */
+void PatchMatch::snapshot(const string& filename) const
+{
+    if (!snapshots) {
+        return;
+    }
+
+    Mat offsets;
+    Mat rgb;
+
+    flow.convertTo(offsets, CV_32F);
+    flow2rgb(offsets, rgb);
+    imwrite(filename, rgb);
+}
+
+/**
+ * One propagation and random search pass over all spans of the current level
+ */
+template <typename T>
+void PatchMatch::sweep(const Mat& image1, const Mat& image2)
+{
+    for (size_t s = 0; s < spans.size(); ++s) {
+        const int row = spans[s][0];
+
+        // check the time budget between blocks of rows
+        if (s % 16 == 0 && interrupted()) {
+            break;
+        }
+
+        #ifndef NDEBUG
+            cerr << "\r" << row;
+        #endif
+        PM_STAT(
+            Point_<T>* offsets = flow.ptr<Point_<T>>(row);
+            stats.iterations.back().pixels += spans[s][2] - spans[s][1];
+        )
+
+        for (int col = spans[s][1]; col < spans[s][2]; ++col) {
+            PM_STAT(const Point_<T> before = offsets[col]);
+
+            float cost = propagate<T>(image1, image2, row, col);
+            random_search<T>(image1, image2, row, col, cost);
+
+            PM_STAT(stats.iterations.back().changed += offsets[col] != before);
+        }
+    }
+    #ifndef NDEBUG
+        cerr << "\r";
+    #endif
+}
+
+/**
+ * Returns the deadline for the given pyramid level. The remaining budget is
+ * split proportional to the estimated costs of the remaining levels. Levels
+ * that were not measured yet are assumed to be as expensive per pixel as the
+ * average of the measured ones.
+ */
+int64 PatchMatch::schedule(int level, const vector<double>& areas)
+{
+    if (deadline == numeric_limits<int64>::max()) {
+        return deadline;
+    }
+
+    double known = 0;
+    int nknown = 0;
+
+    for (int p = 0; p < pyramid; ++p) {
+        if (level_costs[p] > 0) {
+            known += level_costs[p];
+            ++nknown;
+        }
+    }
+
+    const double fallback = nknown > 0 ? known / nknown : 1.0;
+    double total = 0;
+    double own = 0;
+
+    // the current and all finer levels are still to be done
+    for (int p = level; p >= 0; --p) {
+        const double cost = (level_costs[p] > 0 ? level_costs[p] : fallback) * areas[p];
+
+        total += cost;
+        if (p == level) {
+            own = cost;
+        }
+    }
+
+    const int64 now = getTickCount();
+    const int64 remaining = max<int64>(0, deadline - now);
+
+    if (total <= 0) {
+        return deadline;
+    }
+    return now + (int64) (remaining * (own / total));
+}
+
+/**
+ * Checks the cancellation token and the time budget. If the whole budget is
+ * exhausted, the search is marked as incomplete and the remaining levels are
+ * skipped. If only the share of the current level is exhausted, the search
+ * continues in the next finer level.
+ */
+bool PatchMatch::interrupted()
+{
+    if (!progress.complete) {
+        return true;
+    }
+    if (cancel != nullptr && cancel->load()) {
+        progress.complete = false;
+        return true;
+    }
+    if (deadline == numeric_limits<int64>::max()) {
+        return false;
+    }
+
+    const int64 now = getTickCount();
+
+    if (now >= deadline) {
+        progress.complete = false;
+        return true;
+    }
+    // the share of the finest level is everything that is left
+    return now >= level_deadline;
+}
+
+void PatchMatch::update_spans(const Mat& mask)
+{
+    spans.clear();
+
+    for (int row = border; row < nrows - border; ++row) {
+        // without a mask, each row is one span
+        if (mask.empty()) {
+            spans.push_back(Vec3i(row, border, ncols - border));
+            continue;
+        }
+
+        const uchar* m = mask.ptr<uchar>(row);
+
+        for (int col = border; col < ncols - border; ++col) {
+            if (m[col] == 0) {
+                continue;
+            }
+
+            const int first = col;
+
+            while (col < ncols - border && m[col] != 0) {
+                ++col;
+            }
+            spans.push_back(Vec3i(row, first, col));
         }
     }
-    flow.copyTo(dest);
 }
 
+template <typename T>
 void PatchMatch::initialize(const Mat& image1, const Mat& image2)
 {
     #ifndef NDEBUG
@@ -203,8 +740,10 @@ void PatchMatch::initialize(const Mat& image1, const Mat& image2)
     Point2i index;
     Point2i pixel;
 
-    for (int row = border; row < nrows - border ; ++row) {
-        for (int col = border; col < ncols - border ; ++col) {
+    for (size_t s = 0; s < spans.size(); ++s) {
+        const int row = spans[s][0];
+
+        for (int col = spans[s][1]; col < spans[s][2]; ++col) {
             index.x = col;
             index.y = row;
 
@@ -220,22 +759,27 @@ void PatchMatch::initialize(const Mat& image1, const Mat& image2)
                     break;
                 }
             }
-            flow.at<Point2f>(row, col) = offset;
+            flow.at<Point_<T>>(row, col) = offset;
         }
     }
 }
 
+template <typename T>
 float PatchMatch::propagate(const cv::Mat &image1, const cv::Mat &image2, const int row, const int col)
 {
+    typedef typename Offsets<T>::Index Index;
+
     // switch between top and left neighbor in even iterations and
     // right bottom neighbor in odd iterations
     int direction = (niterations % 2 == 0) ? 1 : -1;
 
-    Point2f index(col, row);
+    Index index(col, row);
 
-    Point2f pixel      = index + flow.at<Point2f>(row, col);
-    Point2f y_neighbor = index + flow.at<Point2f>(row + direction, col);  // top or bottom neighbor
-    Point2f x_neighbor = index + flow.at<Point2f>(row, col + direction);  // left or right neighbor
+    Point_<T>* offsets = flow.ptr<Point_<T>>(row);
+
+    Index pixel      = index + Index(offsets[col]);
+    Index y_neighbor = index + Index(flow.at<Point_<T>>(row + direction, col));  // top or bottom neighbor
+    Index x_neighbor = index + Index(offsets[col + direction]);                  // left or right neighbor
 
     // Point2f indices[3] = {
     //     flow.at<Point2f>(row, col),
@@ -265,28 +809,35 @@ float PatchMatch::propagate(const cv::Mat &image1, const cv::Mat &image2, const
     // flow.at<Point2f>(row, col) = indices[minindex];
 
     float costs = ssd(image1, index, image2, pixel, match_radius);
+    PM_STAT(++stats.ssd_calls);
+
+    PM_STAT(stats.border_rejected += !in_borders(x_neighbor) + !in_borders(y_neighbor));
 
     // x-direction (left or right)
-    if (in_borders(x_neighbor)) {
+    if (in_borders(x_neighbor) && !rejected(index, x_neighbor, costs)) {
         float x_costs = ssd(image1, index, image2, x_neighbor, match_radius);
+        PM_STAT(++stats.ssd_calls);
 
         // update offset if the costs of offset of the neighbor in y-direction
         // is smaller
         if (x_costs < costs) {
             costs = x_costs;
-            flow.at<Point2f>(row, col) = flow.at<Point2f>(row, col + direction);
+            offsets[col] = offsets[col + direction];
+            PM_STAT(++stats.x_accepted);
         }
     }
 
     // y-direction (top or bottom)
-    if (in_borders(y_neighbor)) {
+    if (in_borders(y_neighbor) && !rejected(index, y_neighbor, costs)) {
         float y_costs = ssd(image1, index, image2, y_neighbor, match_radius);
+        PM_STAT(++stats.ssd_calls);
 
         // update offset if the costs of offset of the neighbor in y-direction
         // is smaller
         if (y_costs < costs) {
-             costs = y_costs;
-            flow.at<Point2f>(row, col) = flow.at<Point2f>(row + direction, col);
+            costs = y_costs;
+            offsets[col] = flow.at<Point_<T>>(row + direction, col);
+            PM_STAT(++stats.y_accepted);
         }
     }
 
@@ -294,24 +845,18 @@ float PatchMatch::propagate(const cv::Mat &image1, const cv::Mat &image2, const
 }
 
 
+template <typename T>
 void PatchMatch::random_search(const cv::Mat &image1, const cv::Mat &image2, const int row, const int col, float costs)
 {
     const Point2f index(col, row);
-    int i = 0;
-
-    while (true) {
-        const float distance = search_radius * pow(search_ratio, i++);
-
-        // halt condition. search radius must not be smaller
-        // than one pixel
-        if (distance < 1) {
-            break;
-        }
+    int count = 0;
 
+    // generate the candidates for all window sizes up front
+    for (size_t i = 0; i < radii.size(); ++i) {
         // jump randomly in the interval [-1, 1] x [-1, 1]
         Point2f offset = random_interval();
-        offset.x *= distance;
-        offset.y *= distance;
+        offset.x *= radii[i];
+        offset.y *= radii[i];
 
         // calculate center of pixel in the other image
         Point2i center = offset + index;
@@ -319,19 +864,140 @@ void PatchMatch::random_search(const cv::Mat &image1, const cv::Mat &image2, con
         // check if the selected offset is valid, that means:
         //  - it has to be inside the max offset bound
         //  - must be inside the image
-        if (abs(offset.x) <= maxoffset && abs(offset.y) <= maxoffset &&  in_borders(center)) {
-            float match = ssd(image1, index, image2, center, match_radius, costs);
+        if (abs(offset.x) > maxoffset || abs(offset.y) > maxoffset) {
+            PM_STAT(++stats.maxoffset_rejected);
+            continue;
+        }
+        if (!in_borders(center)) {
+            PM_STAT(++stats.border_rejected);
+            continue;
+        }
+        if (!rejected(index, center, costs)) {
+            candidates[count] = offset;
+            centers[count] = center;
+            scales[count] = i;
+            ++count;
 
-            // if better match was found, update the current costs and insert the offset
-            if (match < costs) {
-                costs = match;
-                flow.at<Point2f>(index) = offset;
-            }
+            PM_STAT(++stats.random_tried[i]);
+        }
+    }
+
+    if (count == 0) {
+        return;
+    }
+
+    // score all candidates together. Only candidates that beat the current
+    // costs are of interest, so these are used as common halt value.
+    const int halted = ssd_batch(image1, index, image2, &centers[0], count, match_radius, costs, &scores[0]);
+    (void) halted; // only counted in the statistics
+
+    PM_STAT(
+        stats.ssd_calls += count;
+        stats.ssd_groups += (count + 3) / 4;
+        stats.ssd_halted += halted;
+    )
+
+    // if better match was found, update the current costs and insert the offset.
+    // On equal costs the first candidate wins, like in a sequential search.
+    int best = -1;
+
+    for (int i = 0; i < count; ++i) {
+        if (scores[i] < costs) {
+            costs = scores[i];
+            best = i;
         }
     }
+
+    if (best >= 0) {
+        flow.at<Point_<T>>(row, col) = Offsets<T>::pack(candidates[best], centers[best] - Point2i(col, row));
+        PM_STAT(++stats.random_accepted[scales[best]]);
+    }
 }
 
 bool PatchMatch::in_borders(Point2i point) {
     return border <= point.x && point.x < ncols - border &&
            border <= point.y && point.y < nrows - border;
 }
+
+/**
+ * Returns true if the candidate cannot beat the current costs. The distance of
+ * the patch descriptors is a lower bound of the SSD, so the SSD only has to be
+ * calculated if the bound is lower than the costs.
+ */
+bool PatchMatch::rejected(const Point2i& center1, const Point2i& center2, const float costs)
+{
+    if (!use_descriptors) {
+        return false;
+    }
+
+    const Vec4f& desc1 = descriptors1.at<Vec4f>(center1);
+    const Vec4f& desc2 = descriptors2.at<Vec4f>(center2);
+    const Vec4f diff = desc1 - desc2;
+
+    if (diff.dot(diff) >= costs) {
+        PM_STAT(++stats.descriptor_rejected);
+        return true;
+    }
+    return false;
+}
+
+void PatchMatch::Statistics::clear()
+{
+    ssd_calls           = 0;
+    ssd_halted          = 0;
+    ssd_groups          = 0;
+    x_accepted          = 0;
+    y_accepted          = 0;
+    maxoffset_rejected  = 0;
+    border_rejected     = 0;
+    descriptor_rejected = 0;
+
+    random_tried.clear();
+    random_accepted.clear();
+    iterations.clear();
+}
+
+static void write_list(ostream& out, const vector<int64>& values)
+{
+    out << "[";
+    for (size_t i = 0; i < values.size(); ++i) {
+        out << (i > 0 ? ", " : "") << values[i];
+    }
+    out << "]";
+}
+
+void PatchMatch::Statistics::write(ostream& out) const
+{
+    out << "{" << endl;
+    #ifdef PATCHMATCH_STATS
+        out << "  \"enabled\": true," << endl;
+    #else
+        out << "  \"enabled\": false," << endl;
+    #endif
+    out << "  \"ssd_calls\": " << ssd_calls << "," << endl;
+    out << "  \"ssd_groups\": " << ssd_groups << "," << endl;
+    out << "  \"ssd_halted\": " << ssd_halted << "," << endl;
+    out << "  \"early_termination_rate\": " << (ssd_groups > 0 ? (double) ssd_halted / ssd_groups : 0.0) << "," << endl;
+    out << "  \"x_accepted\": " << x_accepted << "," << endl;
+    out << "  \"y_accepted\": " << y_accepted << "," << endl;
+    out << "  \"maxoffset_rejected\": " << maxoffset_rejected << "," << endl;
+    out << "  \"border_rejected\": " << border_rejected << "," << endl;
+    out << "  \"descriptor_rejected\": " << descriptor_rejected << "," << endl;
+    out << "  \"random_tried\": ";
+    write_list(out, random_tried);
+    out << "," << endl;
+    out << "  \"random_accepted\": ";
+    write_list(out, random_accepted);
+    out << "," << endl;
+    out << "  \"iterations\": [";
+
+    for (size_t i = 0; i < iterations.size(); ++i) {
+        const Iteration& it = iterations[i];
+
+        out << (i > 0 ? "," : "") << endl;
+        out << "    { \"level\": " << it.level << ", \"iteration\": " << it.iteration
+            << ", \"pixels\": " << it.pixels << ", \"changed\": " << it.changed << " }";
+    }
+    out << endl << "  ]" << endl;
+    out << "}" << endl;
+}
@@ -2,10 +2,70 @@
 #define CV2_PATCHMATCH_HPP
 
 #include "opencv2/opencv.hpp"
+#include <atomic>
 #include <limits>
+#include <ostream>
+#include <vector>
+
+// Search statistics are only collected if the library is compiled with
+// PATCHMATCH_STATS, otherwise the counting statements are removed.
+#ifdef PATCHMATCH_STATS
+    #define PM_STAT(...) __VA_ARGS__
+#else
+    #define PM_STAT(...)
+#endif
 
 class PatchMatch
 {
+public:
+    /**
+     * Describes how far the last call of match() got
+     */
+    struct Progress
+    {
+        int level;      // pyramid level the search stopped in (0 is the full resolution)
+        int iteration;  // number of finished iterations in this level
+        bool complete;  // false if the time budget ran out or the search was cancelled
+    };
+
+    /**
+     * Counters of the last call of match(). They stay zero unless the library
+     * is compiled with PATCHMATCH_STATS.
+     */
+    struct Statistics
+    {
+        struct Iteration
+        {
+            int level;
+            int iteration;
+            int64 pixels;   // visited pixels
+            int64 changed;  // pixels whose offset was replaced
+        };
+
+        int64 ssd_calls;            // evaluated patch pairs
+        int64 ssd_halted;           // groups of the random search aborted early
+        int64 ssd_groups;           // groups of the random search
+        int64 x_accepted;           // offsets taken from the left or right neighbor
+        int64 y_accepted;           // offsets taken from the top or bottom neighbor
+        int64 maxoffset_rejected;   // random candidates outside of the maximal offset
+        int64 border_rejected;      // candidates whose patch leaves the image
+        int64 descriptor_rejected;  // candidates rejected by the projected descriptors
+
+        // random search candidates and improvements per window scale, largest first
+        std::vector<int64> random_tried;
+        std::vector<int64> random_accepted;
+
+        std::vector<Iteration> iterations;
+
+        void clear();
+
+        /**
+         * Writes the counters as JSON object
+         */
+        void write(std::ostream& out) const;
+    };
+
+private:
     int nrows;
     int ncols;
     int niterations;
@@ -19,16 +79,70 @@ class PatchMatch
     const bool max_search_radius;
     int search_radius;
 
+    // window sizes of the random search steps, largest first
+    std::vector<float> radii;
+
+    // scratch buffers for the candidates of the random search
+    std::vector<cv::Point2f> candidates;
+    std::vector<cv::Point2i> centers;
+    std::vector<float> scores;
+
     int border;
 
     cv::Mat flow;
 
+    /**
+     * Pixels that are searched in the current pyramid level. Each span is a
+     * run of pixels in one row stored as (row, first column, last column + 1).
+     */
+    std::vector<cv::Vec3i> spans;
+
+    // time budget in seconds. If it is not positive, the search is not limited.
+    double budget;
+    const std::atomic<bool>* cancel;
+    int64 deadline;
+    int64 level_deadline;
+
+    // measured seconds per pixel and iteration for each pyramid level. Zero if
+    // the level was not measured yet.
+    std::vector<double> level_costs;
+
+    Progress progress;
+
+    // projections of all patches, used to reject candidates before the SSD
+    bool use_descriptors;
+    cv::Mat descriptors1;
+    cv::Mat descriptors2;
+
+    void run(const cv::Mat& image1, const cv::Mat& image2, const cv::Mat& mask, cv::Mat& result);
+
+    void update_spans(const cv::Mat& mask);
+
+    // store the offsets as CV_16SC2 instead of CV_32FC2 during the search
+    bool packed;
+
+    // write the flow of each iteration as PNG file
+    bool snapshots;
+
+    Statistics stats;
+
+    // window scale of each random search candidate
+    std::vector<int> scales;
+
+    template <typename T>
     void initialize(const cv::Mat& image1, const cv::Mat& image2);
 
+    template <typename T>
+    void sweep(const cv::Mat& image1, const cv::Mat& image2);
+
+    template <typename T>
     float propagate(const cv::Mat& image1, const cv::Mat& image2, const int row, const int col);
 
+    template <typename T>
     void random_search(const cv::Mat& image1, const cv::Mat& image2, const int row, const int col, float costs);
 
+    void snapshot(const std::string& filename) const;
+
     /**
      * Creates a random point in the interval [-1, 1] x [-1, 1]
      */
@@ -40,17 +154,112 @@ class PatchMatch
 
     inline bool in_borders(cv::Point2i point);
 
+    inline bool rejected(const cv::Point2i& center1, const cv::Point2i& center2, const float costs);
+
+    bool interrupted();
+
+    int64 schedule(int level, const std::vector<double>& areas);
+
 public:
 
     PatchMatch(int maxoffset, int match_radius, int iterations = 5, int pyramid = 3,
                float search_ratio = 0.5, int search_radius = -1);
 
     void match(const cv::Mat& image1, const cv::Mat& image2, cv::Mat& result);
+
+    /**
+     * Limits the run time of each call of match(). If the budget runs out,
+     * match() returns the best flow found so far. The budget is split across
+     * the pyramid levels with respect to their measured costs.
+     *
+     * @param seconds   Time budget. Zero or negative disables the limit.
+     */
+    void set_budget(double seconds);
+
+    /**
+     * Sets a flag that is checked between blocks of rows. If another thread
+     * sets it to true, match() returns the best flow found so far.
+     */
+    void set_cancel(const std::atomic<bool>* token);
+
+    inline const Progress& get_progress() const { return progress; }
+
+    inline const Statistics& get_statistics() const { return stats; }
+
+    /**
+     * Enables the projected patch descriptors. Each candidate is first scored
+     * by the distance of the projections, which is a lower bound of the SSD.
+     * The SSD is only calculated if the bound is lower than the current costs.
+     */
+    void set_descriptors(bool enabled);
+
+    /**
+     * Stores the offsets as packed 16-bit integer pairs during the search.
+     * This halves the memory traffic of the nearest-neighbor field. The
+     * result is converted to CV_32FC2 at the end.
+     */
+    void set_packed(bool enabled);
+
+    /**
+     * Enables or disables writing the flow after each iteration as
+     * "flow-p<level>-i<iteration>.png" into the working directory.
+     */
+    void set_snapshots(bool enabled);
+
+    /**
+     * Computes the flow only for the non-zero pixels of the mask. In each
+     * pyramid level the region is grown by the neighborhood the propagation
+     * step depends on, everything else is skipped, so the result only
+     * approximates the dense search. Pixels outside the mask have a zero
+     * offset in the result.
+     *
+     * Only the search itself is proportional to the masked area. The
+     * pyramid, the dilated masks, the patch descriptors and the final flow
+     * are still computed for the full frames, so a small mask in a large
+     * image does not get correspondingly cheaper.
+     */
+    void match(const cv::Mat& image1, const cv::Mat& image2, const cv::Mat& mask, cv::Mat& result);
+
+    /**
+     * Computes the flow only for the given points of the first image. All
+     * points must lie inside the image. Like the masked variant, only the
+     * search is proportional to the number of points.
+     */
+    void match(const cv::Mat& image1, const cv::Mat& image2, const std::vector<cv::Point2i>& points,
+               cv::Mat& result);
 };
 
-void flow2rgb(const cv::Mat& flow, cv::Mat& rgb);
+/**
+ * Visualizes a CV_32FC2 flow with the Middlebury color wheel as CV_8UC3 image.
+ *
+ * @param max_magnitude Offset length that is mapped to a fully saturated
+ *                      color. Use a fixed value to make several frames
+ *                      comparable. If zero, the largest offset of the flow
+ *                      is used.
+ */
+void flow2rgb(const cv::Mat& flow, cv::Mat& rgb, float max_magnitude = 0);
 
 float ssd(const cv::Mat& image1, const cv::Point2i& center1, const cv::Mat& image2, const cv::Point2i& center2,
           const int radius, const float halt = std::numeric_limits<float>::infinity());
 
+/**
+ * Calculates the SSD between one patch of the first image and several patches
+ * of the second image. The reference patch is loaded once for all candidates
+ * and up to four candidates are compared at the same time. A group of
+ * candidates is aborted after a patch row in which all of them exceeded the
+ * halt value. In that case the returned costs are only partial sums.
+ *
+ * @return  Number of aborted groups
+ */
+int ssd_batch(const cv::Mat& image1, const cv::Point2i& center1, const cv::Mat& image2, const cv::Point2i* centers2,
+              const int count, const int radius, const float halt, float* costs);
+
+/**
+ * Projects each patch of the image onto four orthonormal 2D Walsh functions
+ * (constant, left-right, top-bottom, diagonal). The result is a CV_32FC4
+ * image. Because the basis is orthonormal, the squared distance of two
+ * descriptors is a lower bound of the SSD of the patches.
+ */
+void project_patches(const cv::Mat& image, const int radius, cv::Mat& descriptors);
+
 #endif //CV2_PATCHMATCH_HPP
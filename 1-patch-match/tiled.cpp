@@ -0,0 +1,244 @@
+#include "tiled.hpp"
+#include <fcntl.h>      // open()
+#include <sys/mman.h>   // mmap(), munmap()
+#include <sys/stat.h>   // fstat()
+#include <unistd.h>     // close(), ftruncate(), sysconf()
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+// estimated bytes per pixel of a tile that the matcher allocates: image
+// pyramids, masks, flow and descriptors of both images
+static const size_t tile_bytes_per_pixel = 48;
+
+// bytes per column of one row in all mapped planes: both images, flow and costs
+static const size_t strip_bytes_per_pixel = 2 * sizeof(uchar) + sizeof(Vec2f) + sizeof(float);
+
+MappedPlane::MappedPlane() :
+    fd(-1),
+    type(CV_8UC1),
+    writable(false),
+    base(nullptr),
+    length(0)
+{}
+
+MappedPlane::~MappedPlane()
+{
+    close();
+}
+
+void MappedPlane::open(const string& filename, const Size& size, const int type, const bool create)
+{
+    close();
+
+    const off_t bytes = (off_t) size.width * size.height * CV_ELEM_SIZE(type);
+
+    if (create) {
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+        if (fd < 0 || ftruncate(fd, bytes) != 0) {
+            close();
+            CV_Error(CV_StsError, "Cannot create '" + filename + "'");
+        }
+    } else {
+        fd = ::open(filename.c_str(), O_RDONLY);
+
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            close();
+            CV_Error(CV_StsError, "Cannot open '" + filename + "'");
+        }
+        if (info.st_size < bytes) {
+            close();
+            CV_Error(CV_StsError, "'" + filename + "' is smaller than the given image size");
+        }
+    }
+
+    this->dims     = size;
+    this->type     = type;
+    this->writable = create;
+}
+
+void MappedPlane::close()
+{
+    unmap();
+
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+Mat MappedPlane::map(const int first, const int last)
+{
+    CV_Assert(fd >= 0 && 0 <= first && first < last && last <= dims.height);
+
+    unmap();
+
+    const size_t step    = (size_t) dims.width * CV_ELEM_SIZE(type);
+    const off_t  offset  = (off_t) first * step;
+    const off_t  aligned = offset - offset % sysconf(_SC_PAGESIZE);
+
+    length = (size_t) (last - first) * step + (size_t) (offset - aligned);
+    base   = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, aligned);
+
+    if (base == MAP_FAILED) {
+        base   = nullptr;
+        length = 0;
+        CV_Error(CV_StsError, "Cannot map image rows");
+    }
+
+    // rows are visited in order, let the kernel read ahead
+    madvise(base, length, MADV_SEQUENTIAL);
+
+    return Mat(last - first, dims.width, type, (uchar*) base + (offset - aligned), step);
+}
+
+void MappedPlane::unmap()
+{
+    if (base != nullptr) {
+        munmap(base, length);
+        base   = nullptr;
+        length = 0;
+    }
+}
+
+TiledPatchMatch::TiledPatchMatch(int maxoffset, int match_radius, int iterations, int pyramid,
+                                 float search_ratio, int search_radius, size_t budget) :
+    matcher(maxoffset, match_radius, iterations, pyramid, search_ratio, search_radius),
+    maxoffset(maxoffset),
+    match_radius(match_radius),
+    budget(budget),
+    overlap(2 * match_radius)
+{
+    // every tile would write its own PNG files otherwise
+    matcher.set_snapshots(false);
+}
+
+void TiledPatchMatch::set_budget(size_t bytes)
+{
+    budget = bytes;
+}
+
+/**
+ * Returns the edge length of the tiles without halo and overlap. A strip of
+ * mapped rows costs strip_bytes_per_pixel * width bytes per row and the
+ * matcher about tile_bytes_per_pixel per pixel of the extended tile. The
+ * extended tile size s is the positive root of
+ *
+ *     tile_bytes_per_pixel * s^2 + strip_bytes_per_pixel * width * s = budget
+ */
+int TiledPatchMatch::tile_size(const Size& size) const
+{
+    const double a = tile_bytes_per_pixel;
+    const double b = (double) strip_bytes_per_pixel * size.width;
+    const double extended = (-b + sqrt(b * b + 4 * a * budget)) / (2 * a);
+
+    const int tile = (int) extended - 2 * (maxoffset + match_radius + overlap);
+
+    if (tile < 2 * overlap || tile < 16) {
+        CV_Error(CV_StsBadArg, "Memory budget is too small for the image width and the maximal offset");
+    }
+
+    return min(tile, max(size.width, size.height));
+}
+
+/**
+ * Copies the offsets of the region into the flow plane if their SSD is lower
+ * than the costs already stored for the pixel by a neighbouring tile.
+ */
+void TiledPatchMatch::reconcile(const Mat& image1, const Mat& image2, const Mat& result,
+                                const Rect& region, Mat& flow, Mat& costs) const
+{
+    for (int row = 0; row < region.height; ++row) {
+        for (int col = 0; col < region.width; ++col) {
+            const Point2i center1(region.x + col, region.y + row);
+            const Vec2f& offset = result.at<Vec2f>(center1);
+            const Point2i center2(center1.x + cvRound(offset[0]), center1.y + cvRound(offset[1]));
+
+            // pixels at the image border have no valid offset
+            if (center1.x < match_radius || center1.x >= image1.cols - match_radius ||
+                center1.y < match_radius || center1.y >= image1.rows - match_radius ||
+                center2.x < match_radius || center2.x >= image2.cols - match_radius ||
+                center2.y < match_radius || center2.y >= image2.rows - match_radius) {
+                continue;
+            }
+
+            float& best = costs.at<float>(row, col);
+            const float cost = ssd(image1, center1, image2, center2, match_radius, best);
+
+            if (cost < best) {
+                best = cost;
+                flow.at<Vec2f>(row, col) = offset;
+            }
+        }
+    }
+}
+
+void TiledPatchMatch::match(const string& image1, const string& image2, const Size& size,
+                            const string& output)
+{
+    MappedPlane plane1;
+    MappedPlane plane2;
+    MappedPlane flow;
+    MappedPlane costs;
+
+    plane1.open(image1, size, CV_8UC1);
+    plane2.open(image2, size, CV_8UC1);
+    flow.open(output, size, CV_32FC2, true);
+    costs.open(output + ".cost", size, CV_32FC1, true);
+
+    const int tile = tile_size(size);
+    const int halo = maxoffset + match_radius;
+
+    // rows of the cost plane that have been set to infinity
+    int initialized = 0;
+
+    for (int y = 0; y < size.height; y += tile) {
+        // rows written by this strip and rows needed to match them
+        const int write_first = max(0, y - overlap);
+        const int write_last  = min(size.height, y + tile + overlap);
+        const int crop_first  = max(0, write_first - halo);
+        const int crop_last   = min(size.height, write_last + halo);
+
+        Mat strip1 = plane1.map(crop_first, crop_last);
+        Mat strip2 = plane2.map(crop_first, crop_last);
+        Mat flow_strip  = flow.map(write_first, write_last);
+        Mat costs_strip = costs.map(write_first, write_last);
+
+        // rows below the previous strip were not written yet
+        if (initialized < write_last) {
+            const Range fresh(max(initialized, write_first) - write_first, write_last - write_first);
+            costs_strip.rowRange(fresh).setTo(Scalar::all(numeric_limits<float>::infinity()));
+            initialized = write_last;
+        }
+
+        for (int x = 0; x < size.width; x += tile) {
+            const int write_left  = max(0, x - overlap);
+            const int write_right = min(size.width, x + tile + overlap);
+            const int crop_left   = max(0, write_left - halo);
+            const int crop_right  = min(size.width, write_right + halo);
+
+            const Rect crop(crop_left, 0, crop_right - crop_left, crop_last - crop_first);
+            const Rect region(write_left - crop_left, write_first - crop_first,
+                              write_right - write_left, write_last - write_first);
+            const Rect target(write_left, 0, write_right - write_left, write_last - write_first);
+
+            Mat tile1 = strip1(crop);
+            Mat tile2 = strip2(crop);
+            Mat result;
+
+            matcher.match(tile1, tile2, result);
+
+            Mat flow_tile  = flow_strip(target);
+            Mat costs_tile = costs_strip(target);
+
+            reconcile(tile1, tile2, result, region, flow_tile, costs_tile);
+        }
+
+#ifndef NDEBUG
+        cerr << "tiled: rows " << write_first << " - " << write_last << " of " << size.height << endl;
+#endif
+    }
+}
@@ -0,0 +1,98 @@
+#ifndef CV2_TILED_HPP
+#define CV2_TILED_HPP
+
+#include "patchmatch.hpp"
+#include <string>
+
+/**
+ * Image plane stored in a headerless raw file (row-major, no padding). Only a
+ * window of rows is mapped into memory at a time, so planes larger than the
+ * main memory can be processed.
+ */
+class MappedPlane
+{
+    int fd;
+    cv::Size dims;
+    int type;
+    bool writable;
+
+    // mapped window, aligned to the page size
+    void* base;
+    size_t length;
+
+public:
+    MappedPlane();
+    ~MappedPlane();
+
+    /**
+     * Opens an existing plane. If create is true, the file is created or
+     * truncated to the size of the plane and mapped writable.
+     */
+    void open(const std::string& filename, const cv::Size& size, const int type, const bool create = false);
+    void close();
+
+    /**
+     * Maps the rows [first, last) and returns them as matrix. The previous
+     * window is unmapped, so matrices returned earlier become invalid.
+     */
+    cv::Mat map(const int first, const int last);
+
+    /**
+     * Writes back and releases the mapped window.
+     */
+    void unmap();
+
+    cv::Size size() const { return dims; }
+};
+
+/**
+ * Runs PatchMatch on image pairs that do not fit into memory. The first image
+ * is split into tiles which are processed one after another. Each tile is
+ * extended by a halo of maxoffset + match_radius pixels, so that all
+ * candidates of its pixels are inside the cropped region of both images.
+ * Neighbouring tiles overlap by a small band in which the offset with the
+ * lower SSD wins.
+ *
+ * The tile size is derived from a memory budget. Only one strip of tile rows
+ * of the input and output planes is mapped at a time.
+ */
+class TiledPatchMatch
+{
+    PatchMatch matcher;
+
+    const int maxoffset;
+    const int match_radius;
+
+    // memory budget in bytes
+    size_t budget;
+
+    // width of the band in which neighbouring tiles overlap
+    int overlap;
+
+    int tile_size(const cv::Size& size) const;
+
+    void reconcile(const cv::Mat& image1, const cv::Mat& image2, const cv::Mat& result,
+                   const cv::Rect& region, cv::Mat& flow, cv::Mat& costs) const;
+
+public:
+    TiledPatchMatch(int maxoffset, int match_radius, int iterations = 5, int pyramid = 3,
+                    float search_ratio = 0.5, int search_radius = -1, size_t budget = 512 << 20);
+
+    /**
+     * Gives access to the matcher used for each tile, e.g. to enable
+     * descriptors or packed offsets.
+     */
+    PatchMatch& get_matcher() { return matcher; }
+
+    void set_budget(size_t bytes);
+
+    /**
+     * Computes the flow between two raw CV_8UC1 planes of the given size. The
+     * flow is written as raw CV_32FC2 plane into the output file. A second
+     * file with the suffix ".cost" holds the SSD of each offset as CV_32FC1.
+     */
+    void match(const std::string& image1, const std::string& image2, const cv::Size& size,
+               const std::string& output);
+};
+
+#endif //CV2_TILED_HPP
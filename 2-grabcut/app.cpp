@@ -22,6 +22,8 @@ static void usage()
          << "                          Default: false" << endl
          << "    -n, --neighbors       Neighborhood system that should be used." << endl
          << "                          Default: 8" << endl
+         << "    -s, --solver          Max-flow algorithm (bk, ibfs or pr)." << endl
+         << "                          Default: bk" << endl
          << endl;
 }
 
@@ -70,6 +72,21 @@ static void getBinMask(const Mat &comMask, Mat &binMask)
     binMask = comMask & 1;
 }
 
+// command line names of the max-flow algorithms, indexed by GC_MAXFLOW_*
+static const char* const MAXFLOW_NAMES[] = { "bk", "pr", "ibfs" };
+
+static int parseMaxflow(const string &name)
+{
+    for (int maxflow = 0; maxflow < 3; maxflow++) {
+        if (name == MAXFLOW_NAMES[maxflow]) {
+            return maxflow;
+        }
+    }
+    return -1;
+}
+
+static inline const char* maxflowName(int maxflow) { return MAXFLOW_NAMES[maxflow]; }
+
 class GCApplication
 {
   public:
@@ -84,12 +101,13 @@ class GCApplication
     static const int thickness = -1;
 
     GCApplication(double tolerance = MAX_TOLERANCE, double connectivity = 1, double contrast = 1,
-                  bool extended = false, int neighbors = GC_N8) :
+                  bool extended = false, int neighbors = GC_N8, int maxflow = GC_MAXFLOW_BK) :
         tolerance(tolerance),
         connectivity(connectivity),
         contrast(contrast),
         extended(extended),
         neighbors(neighbors),
+        maxflow(maxflow),
         image(nullptr),
         winName(nullptr)
     {}
@@ -149,6 +167,7 @@ class GCApplication
     double contrast;        // boost cutting of edges in hight contrast reagions
     bool extended;          // use an extended term of the pairwise term
     int neighbors;          // numer of connected neighbor pixels (aka. graph connectivity)
+    int maxflow;            // algorithm for the min-cut calculation
 };
 
 void GCApplication::reset()
@@ -326,9 +345,12 @@ void GCApplication::mouseClick(int event, int x, int y, int flags)
 
 int GCApplication::nextIter()
 {
+    GrabCutOptions options;
+    options.maxflow = maxflow;
+
     if (isInitialized) {
         extendedGrabCut(*image, mask, rect, backgroundModel, foregroundModel, 1,
-                        tolerance, extended, connectivity, contrast, neighbors);
+                        tolerance, extended, connectivity, contrast, neighbors, GC_EVAL, options);
     } else {
         // if the application not initialized and the rectangular is not set up be the user
         // we do nothing
@@ -341,10 +363,12 @@ int GCApplication::nextIter()
         // if the user provides brush strokes, use them as mask for the initial iteration
         if (labelsState == SET || probablyLabelsState == SET) {
             extendedGrabCut(*image, mask, rect, backgroundModel, foregroundModel, 1,
-                            tolerance, extended, connectivity, contrast, neighbors, GC_INIT_WITH_MASK);
+                            tolerance, extended, connectivity, contrast, neighbors, GC_INIT_WITH_MASK,
+                            options);
         } else {
             extendedGrabCut(*image, mask, rect, backgroundModel, foregroundModel, 1,
-                            tolerance, extended, connectivity, contrast, neighbors, GC_INIT_WITH_RECT);
+                            tolerance, extended, connectivity, contrast, neighbors, GC_INIT_WITH_RECT,
+                            options);
         }
         // after the initial iteration, the application is initialized
         isInitialized = true;
@@ -372,6 +396,7 @@ ostream& operator<< (ostream& stream, const GCApplication& gcapp)
     return stream << "GCApplication" << endl
                   << "    extended binary:  " << (gcapp.extended ? "true" : "false") << endl
                   << "    neighbors:        " << gcapp.neighbors << endl
+                  << "    solver:           " << maxflowName(gcapp.maxflow) << endl
                   << "    tolerance:        " << gcapp.tolerance << endl
                   << "    connectivity:     " << gcapp.connectivity  << endl
                   << "    contrast:         " << gcapp.contrast  << endl;
@@ -402,7 +427,7 @@ static void onConnectivityTrackbar(int value, void* gcapp)
 }
 
 
-int appLoop(const Mat& image, bool extended, int neighbors)
+int appLoop(const Mat& image, bool extended, int neighbors, int maxflow)
 {
     // trackbar parameters
     int toleranceSlider = 50;
@@ -421,7 +446,8 @@ int appLoop(const Mat& image, bool extended, int neighbors)
                         trackbarToConnectivity(connectivitySlider),
                         trackbarToContrast(contrastSlider),
                         extended,
-                        neighbors);
+                        neighbors,
+                        maxflow);
 
     const string winName = "image";
     namedWindow(winName, WINDOW_AUTOSIZE);
@@ -491,10 +517,13 @@ int main(int argc, char **argv)
     struct arg_lit*  version     = arg_lit0("v", "version",                   "Print version information and exit");
     struct arg_lit*  extended    = arg_lit0("e", "extended",                  "Use an extended pairwise term");
     struct arg_int*  neighbors   = arg_int0("n", "neighbors", nullptr,        "Neighborhood system that should be used (4 or 8)");
+    struct arg_str*  solver      = arg_str0("s", "solver", "bk|ibfs|pr",      "Max-flow algorithm for the min-cut calculation");
     struct arg_file *infile      = arg_filen(nullptr, nullptr, "image", 1, 1, "input image");
     struct arg_end  *end     = arg_end(20);
 
-    void* argtable[] = { help, version, extended, neighbors, infile, end };
+    void* argtable[] = { help, version, extended, neighbors, solver, infile, end };
+
+    int maxflow;
 
     const char* progname = "grabcut";
 
@@ -511,6 +540,7 @@ int main(int argc, char **argv)
 
     // set any command line default values prior to parsing
     neighbors->ival[0] = GC_N8;
+    solver->sval[0] = "bk";
 
     // Parse the command line as defined by argtable[]
     nerrors = arg_parse(argc, argv, argtable);
@@ -564,6 +594,15 @@ int main(int argc, char **argv)
         goto exit;
     }
 
+    // sanitize solver parameter
+    maxflow = parseMaxflow(solver->sval[0]);
+    if (maxflow < 0) {
+        cerr << "Error: Unknown solver '" << solver->sval[0] << "'" << endl;
+
+        exitcode = 1;
+        goto exit;
+    }
+
     // try to read input image
     image = imread(*(infile->filename), CV_LOAD_IMAGE_COLOR);
     if (image.empty()) {
@@ -573,7 +612,7 @@ int main(int argc, char **argv)
         goto exit;
     }
 
-    appLoop(image, extended->count > 0, neighbors->ival[0]);
+    appLoop(image, extended->count > 0, neighbors->ival[0], maxflow);
 
     exit:
     // deallocate each non-null entry in argtable[]
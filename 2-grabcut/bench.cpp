@@ -0,0 +1,552 @@
+#include <cassert>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "argtable2.h"
+
+#include "gcgraph.hpp"
+#include "gcgridgraph.hpp"
+#include "gcibfsgraph.hpp"
+#include "gcpushrelabel.hpp"
+#include "grabcut.hpp"
+
+using namespace std;
+using namespace cv;
+
+// GrabCut options that are compared in one table
+struct Setting
+{
+    string name;
+    GrabCutOptions options;
+};
+
+/**
+ * Max-flow algorithms and capacity types in the order of the report
+ */
+static vector<Setting> solverSettings()
+{
+    static const struct { const char *name; int maxflow; int weightType; } SOLVERS[] = {
+        { "bk",     GC_MAXFLOW_BK,           CV_64F },
+        { "ibfs",   GC_MAXFLOW_IBFS,         CV_64F },
+        { "pr",     GC_MAXFLOW_PUSH_RELABEL, CV_64F },
+        { "bk/32f", GC_MAXFLOW_BK,           CV_32F },
+        { "bk/32s", GC_MAXFLOW_BK,           CV_32S },
+    };
+
+    vector<Setting> settings(sizeof(SOLVERS) / sizeof(SOLVERS[0]));
+    for (size_t i = 0; i < settings.size(); i++) {
+        settings[i].name = SOLVERS[i].name;
+        settings[i].options.maxflow = SOLVERS[i].maxflow;
+        settings[i].options.weightType = SOLVERS[i].weightType;
+    }
+    return settings;
+}
+
+/**
+ * Color models, compared with the GMM
+ */
+static vector<Setting> modelSettings()
+{
+    static const struct { const char *name; int colorModel; int bins; } MODELS[] = {
+        { "gmm",     GC_COLOR_GMM,        0 },
+        { "hist/8",  GC_COLOR_HISTOGRAM,  8 },
+        { "hist/16", GC_COLOR_HISTOGRAM, 16 },
+        { "hist/32", GC_COLOR_HISTOGRAM, 32 },
+    };
+
+    vector<Setting> settings(sizeof(MODELS) / sizeof(MODELS[0]));
+    for (size_t i = 0; i < settings.size(); i++) {
+        settings[i].name = MODELS[i].name;
+        settings[i].options.colorModel = MODELS[i].colorModel;
+        if (MODELS[i].bins > 0) {
+            settings[i].options.histogramBins = MODELS[i].bins;
+        }
+    }
+    return settings;
+}
+
+/**
+ * Superpixel graphs of different sizes, with and without the refinement of the
+ * boundary, compared with the pixel graph
+ */
+static vector<Setting> superpixelSettings()
+{
+    static const struct { const char *name; int size; bool refine; } SUPERPIXELS[] = {
+        { "pixels",  0,  true  },
+        { "sp/6",    6,  true  },
+        { "sp/10",   10, true  },
+        { "sp/10c",  10, false },
+        { "sp/16",   16, true  },
+    };
+
+    vector<Setting> settings(sizeof(SUPERPIXELS) / sizeof(SUPERPIXELS[0]));
+    for (size_t i = 0; i < settings.size(); i++) {
+        settings[i].name = SUPERPIXELS[i].name;
+        settings[i].options.superpixelSize = SUPERPIXELS[i].size;
+        settings[i].options.refineSuperpixels = SUPERPIXELS[i].refine;
+    }
+    return settings;
+}
+
+// side lengths of the synthetic images if none are given
+static const int DEFAULT_GRIDS[] = { 256, 512, 1024 };
+
+/**
+ * Creates a noisy ellipse on a noisy background with a smooth gradient. The
+ * image is the same in each run. The ellipse is drawn into truth as well.
+ */
+static Mat syntheticImage(int size, Mat &truth)
+{
+    Mat image(size, size, CV_8UC3);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            image.at<Vec3b>(y, x) = Vec3b(saturate_cast<uchar>(60 + 80 * x / size),
+                                          saturate_cast<uchar>(120 - 40 * y / size),
+                                          90);
+        }
+    }
+    ellipse(image, Point(size / 2, size / 2), Size(size / 4, size / 3), 30, 0, 360, Scalar(40, 90, 190), -1);
+
+    truth = Mat::zeros(size, size, CV_8UC1);
+    ellipse(truth, Point(size / 2, size / 2), Size(size / 4, size / 3), 30, 0, 360, Scalar(1), -1);
+
+    RNG rng(0x2015);
+    Mat noise(image.size(), CV_16SC3);
+    rng.fill(noise, RNG::NORMAL, 0, 25);
+
+    Mat noisy;
+    image.convertTo(noisy, CV_16SC3);
+    noisy += noise;
+    noisy.convertTo(image, CV_8UC3);
+    return image;
+}
+
+/**
+ * Runs GrabCut from a rectangle with a margin of 1/8 of the image size, where
+ * the object is expected. Returns the time of the whole extendedGrabCut() call
+ * in seconds, which includes the color models and the graph construction, not
+ * only the max-flow algorithm.
+ */
+static double timeGrabCut(const Mat &image, int iterations, int neighbors, const GrabCutOptions &options,
+                          Mat &foreground)
+{
+    const Rect rect(image.cols / 8, image.rows / 8, image.cols * 3 / 4, image.rows * 3 / 4);
+    Mat mask, bgdModel, fgdModel;
+
+    const int64 start = getTickCount();
+    extendedGrabCut(image, mask, rect, bgdModel, fgdModel, iterations, 1, false, 1, 1,
+                    neighbors, GC_INIT_WITH_RECT, options);
+    const double elapsed = (getTickCount() - start) / getTickFrequency();
+
+    foreground = mask & 1;
+    return elapsed;
+}
+
+/**
+ * Runs GrabCut with each setting from the same rectangle and prints one line
+ * per setting. The cut of the first one is the reference for the others. If
+ * the true segmentation is known, the wrong pixels are counted as well.
+ */
+static void benchmark(const string &name, const Mat &image, const Mat &truth, int iterations, int neighbors,
+                      const vector<Setting> &settings)
+{
+    Mat reference;
+    for (size_t s = 0; s < settings.size(); s++) {
+        Mat foreground;
+        const double elapsed = timeGrabCut(image, iterations, neighbors, settings[s].options, foreground);
+
+        // the max-flow algorithms find the same cut, only the capacity types,
+        // color models and superpixels may differ
+        if (reference.empty()) {
+            reference = foreground;
+        }
+        const int differences = countNonZero(foreground != reference);
+
+        printf("%-24s %5dx%-5d %-7s %10.1f ms total  %8d px  %6d px different", name.c_str(), image.cols,
+               image.rows, settings[s].name.c_str(), elapsed * 1000, countNonZero(foreground), differences);
+        if (!truth.empty()) {
+            printf("  %6d px wrong", countNonZero(foreground != truth));
+        }
+        printf("\n");
+    }
+}
+
+/**
+ * Compares iterations 2..N with and without reusing the flow and search trees
+ * of the previous iteration. Their time is the difference between a run with
+ * N iterations and a run with one iteration, which do the same
+ * initialization and first iteration.
+ */
+static void benchmarkReuse(const string &name, const Mat &image, int iterations, int neighbors)
+{
+    if (iterations < 2) {
+        return;
+    }
+
+    Mat reference;
+    for (int dynamic = 0; dynamic < 2; dynamic++) {
+        GrabCutOptions options;
+        options.dynamic = dynamic != 0;
+
+        Mat first, foreground;
+        const double firstElapsed = timeGrabCut(image, 1, neighbors, options, first);
+        const double elapsed = timeGrabCut(image, iterations, neighbors, options, foreground);
+
+        if (reference.empty()) {
+            reference = foreground;
+        }
+        const int differences = countNonZero(foreground != reference);
+
+        printf("%-24s %5dx%-5d %-7s %10.1f ms total  %8d px  %6d px different  (iterations 2..%d)\n", name.c_str(),
+               image.cols, image.rows, dynamic ? "reuse" : "fresh", (elapsed - firstElapsed) * 1000,
+               countNonZero(foreground), differences, iterations);
+    }
+}
+
+// largest number of threads of the thread sweep
+static const int SWEEP_THREADS = 32;
+
+/**
+ * Runs the push-relabel algorithm with 1, 2, 4 ... SWEEP_THREADS threads and
+ * prints the time and the speedup over one thread for each count. The cut
+ * with one thread is the reference for the others. Restores the number of
+ * threads afterwards.
+ */
+static void benchmarkThreads(const string &name, const Mat &image, int iterations, int neighbors)
+{
+    const int saved = getNumThreads();
+
+    GrabCutOptions options;
+    options.maxflow = GC_MAXFLOW_PUSH_RELABEL;
+
+    Mat reference;
+    double single = 0;
+    for (int threads = 1; threads <= SWEEP_THREADS; threads *= 2) {
+        setNumThreads(threads);
+
+        Mat foreground;
+        const double elapsed = timeGrabCut(image, iterations, neighbors, options, foreground);
+
+        if (reference.empty()) {
+            reference = foreground;
+            single = elapsed;
+        }
+        const int differences = countNonZero(foreground != reference);
+
+        printf("%-24s %5dx%-5d pr %3d threads %10.1f ms total  %5.2fx  %6d px different\n", name.c_str(),
+               image.cols, image.rows, threads, elapsed * 1000, single / elapsed, differences);
+    }
+
+    setNumThreads(saved);
+}
+
+// number of random graphs per neighborhood system of the max-flow check
+static const int CHECK_GRAPHS = 500;
+
+/**
+ * Random grid graph with integer capacities, on which all max-flow algorithms
+ * must find the same flow and source segment
+ */
+struct CheckGraph
+{
+    int width, height;
+    vector<int> caps;                   // capacity to the neighbor in each direction
+    vector<int> sourceW, sinkW;         // terminal weights of the first run
+    vector<int> newSourceW, newSinkW;   // terminal weights of the second run
+};
+
+/**
+ * Flows and source segments of one max-flow algorithm on a CheckGraph
+ */
+struct CheckResult
+{
+    double flow, newFlow, reusedFlow;
+    vector<uchar> segment, newSegment, reusedSegment;
+};
+
+static CheckGraph randomCheckGraph(RNG &rng, int neighbors)
+{
+    CheckGraph graph;
+    graph.width = rng.uniform(1, 48);
+    graph.height = rng.uniform(1, 48);
+
+    const int count = graph.width * graph.height;
+    graph.caps.resize(count * neighbors);
+    for (size_t i = 0; i < graph.caps.size(); i++) {
+        graph.caps[i] = rng.uniform(0, 10);
+    }
+
+    // a quarter of the terminal weights changes for the second run
+    graph.sourceW.resize(count);
+    graph.sinkW.resize(count);
+    for (int i = 0; i < count; i++) {
+        graph.sourceW[i] = rng.uniform(0, 20);
+        graph.sinkW[i] = rng.uniform(0, 20);
+    }
+    graph.newSourceW = graph.sourceW;
+    graph.newSinkW = graph.sinkW;
+    for (int i = 0; i < count; i++) {
+        if (rng.uniform(0, 4) == 0) {
+            graph.newSourceW[i] = rng.uniform(0, 20);
+            graph.newSinkW[i] = rng.uniform(0, 20);
+        }
+    }
+    return graph;
+}
+
+static void createGraph(GCGraph<int> &graph, int width, int height, int neighbors)
+{
+    graph.create(width * height, width * height * neighbors);
+    for (int i = 0; i < width * height; i++) {
+        graph.addVtx();
+    }
+}
+
+template <class Graph>
+static void createGraph(Graph &graph, int width, int height, int)
+{
+    graph.create(width, height);
+}
+
+/**
+ * Solves the graph with the first terminal weights, then with the second ones
+ * on the residual graph, and with the second ones on a new graph
+ */
+template <class Graph>
+static CheckResult solveCheckGraph(const CheckGraph &check, int neighbors)
+{
+    const int count = check.width * check.height;
+    CheckResult result;
+    Graph graph, newGraph;
+
+    createGraph(graph, check.width, check.height, neighbors);
+    createGraph(newGraph, check.width, check.height, neighbors);
+    for (int i = 0; i < count; i++) {
+        const int x = i % check.width, y = i / check.width;
+
+        // the directions with odd index point forward, d ^ 1 is the opposite
+        for (int d = 1; d < neighbors; d += 2) {
+            const int qx = x + gcGridDx[d], qy = y + gcGridDy[d];
+            if (qx < 0 || qx >= check.width || qy >= check.height) {
+                continue;
+            }
+            const int j = qy * check.width + qx;
+            graph.addEdges(i, j, check.caps[i * neighbors + d], check.caps[j * neighbors + (d ^ 1)]);
+            newGraph.addEdges(i, j, check.caps[i * neighbors + d], check.caps[j * neighbors + (d ^ 1)]);
+        }
+        graph.addTermWeights(i, check.sourceW[i], check.sinkW[i]);
+        newGraph.addTermWeights(i, check.newSourceW[i], check.newSinkW[i]);
+    }
+
+    result.flow = graph.maxFlow();
+    result.segment.resize(count);
+    for (int i = 0; i < count; i++) {
+        result.segment[i] = graph.inSourceSegment(i);
+    }
+
+    for (int i = 0; i < count; i++) {
+        graph.updateTermWeights(i, check.newSourceW[i], check.newSinkW[i]);
+    }
+    result.reusedFlow = graph.maxFlow(true);
+    result.reusedSegment.resize(count);
+    for (int i = 0; i < count; i++) {
+        result.reusedSegment[i] = graph.inSourceSegment(i);
+    }
+
+    result.newFlow = newGraph.maxFlow();
+    result.newSegment.resize(count);
+    for (int i = 0; i < count; i++) {
+        result.newSegment[i] = newGraph.inSourceSegment(i);
+    }
+    return result;
+}
+
+/**
+ * Compares the flows and source segments of the max-flow algorithms with
+ * GCGraph on random graphs. The source segment is the set of vertices that
+ * can be reached from the source in the residual graph, which is unique, so
+ * the cuts must be identical. Returns the number of mismatches.
+ */
+template <int neighbors>
+static int checkMaxFlow(RNG &rng)
+{
+    static const char *NAMES[] = { "bk/grid", "ibfs", "pr" };
+    int flowErrors[3] = { 0 }, cutErrors[3] = { 0 }, reuseErrors[3] = { 0 };
+    int referenceErrors = 0;
+
+    for (int n = 0; n < CHECK_GRAPHS; n++) {
+        const CheckGraph check = randomCheckGraph(rng, neighbors);
+
+        const CheckResult reference = solveCheckGraph<GCGraph<int> >(check, neighbors);
+        if (reference.reusedFlow != reference.newFlow || reference.reusedSegment != reference.newSegment) {
+            referenceErrors++;
+        }
+
+        const CheckResult results[3] = {
+            solveCheckGraph<GCGridGraph<int, neighbors> >(check, neighbors),
+            solveCheckGraph<GCIBFSGraph<int, neighbors> >(check, neighbors),
+            solveCheckGraph<GCPushRelabelGraph<int, neighbors> >(check, neighbors),
+        };
+        for (int s = 0; s < 3; s++) {
+            flowErrors[s] += results[s].flow != reference.flow || results[s].newFlow != reference.newFlow;
+            cutErrors[s] += results[s].segment != reference.segment || results[s].newSegment != reference.newSegment;
+            reuseErrors[s] += results[s].reusedFlow != reference.newFlow ||
+                              results[s].reusedSegment != reference.newSegment;
+        }
+    }
+
+    // GCGraph is only checked against itself
+    printf("check N%d %-8s %5d graphs  %4s different flows  %4s different cuts  %4d wrong after reuse\n",
+           neighbors, "bk", CHECK_GRAPHS, "-", "-", referenceErrors);
+    int errors = referenceErrors;
+    for (int s = 0; s < 3; s++) {
+        printf("check N%d %-8s %5d graphs  %4d different flows  %4d different cuts  %4d wrong after reuse\n",
+               neighbors, NAMES[s], CHECK_GRAPHS, flowErrors[s], cutErrors[s], reuseErrors[s]);
+        errors += flowErrors[s] + cutErrors[s] + reuseErrors[s];
+    }
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    // Command line options and arguments
+    struct arg_lit*  help        = arg_lit0("h", "help",                       "Show this help message");
+    struct arg_int*  iterations  = arg_int0("i", "iterations", nullptr,        "Number of GrabCut iterations (default 5)");
+    struct arg_int*  neighbors   = arg_int0("n", "neighbors", nullptr,         "Neighborhood system that should be used (4 or 8)");
+    struct arg_int*  grids       = arg_intn("g", "grid", "size", 0, 16,        "Side length of a synthetic image (default 256, 512 and 1024)");
+    struct arg_int*  threads     = arg_int0("t", "threads", nullptr,           "Number of threads (default all cores)");
+    struct arg_lit*  check       = arg_lit0("c", "check",                      "Compare the cuts of the max-flow algorithms on random graphs");
+    struct arg_lit*  sweep       = arg_lit0("s", "sweep",                      "Time push-relabel with 1, 2, 4 ... 32 threads instead of the tables");
+    struct arg_file* infiles     = arg_filen(nullptr, nullptr, "image", 0, 64, "input images");
+    struct arg_end  *end     = arg_end(20);
+
+    void* argtable[] = { help, iterations, neighbors, grids, threads, check, sweep, infiles, end };
+
+    const char* progname = "gcbench";
+
+    int nerrors;
+    int exitcode = 0;
+
+    // verify the argtable[] entries were allocated sucessfully
+    if (arg_nullcheck(argtable) != 0) {
+        printf("%s: insufficient memory\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    // set any command line default values prior to parsing
+    iterations->ival[0] = 5;
+    neighbors->ival[0] = GC_N8;
+    threads->ival[0] = getNumThreads();
+
+    // Parse the command line as defined by argtable[]
+    nerrors = arg_parse(argc, argv, argtable);
+
+    // special case: '--help' takes precedence over error reporting
+    if (help->count > 0) {
+        cout << "Usage: " << progname << " [options] [image ...]" << endl
+             << endl
+             << "Compares the run time of the max-flow algorithms and capacity types of" << endl
+             << "GrabCut on the given images and on synthetic images, the run time and" << endl
+             << "accuracy of the GMM and histogram color models and of superpixel graphs" << endl
+             << "(sp/10c without refining the boundary), and the run time of the" << endl
+             << "iterations after the first with and without reusing the search trees." << endl
+             << "The times are end-to-end: they include the color models and the graph" << endl
+             << "construction, not only the max-flow algorithm." << endl
+             << "With --check, it compares the flows and cuts of the max-flow algorithms" << endl
+             << "on random graphs instead and fails if they differ." << endl
+             << "With --sweep, it only times the push-relabel algorithm with 1, 2, 4 ... 32" << endl
+             << "threads on each image." << endl
+             << endl;
+
+        arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+
+        exitcode = 0;
+        goto exit;
+    }
+
+    // If the parser returned any errors then display them and exit
+    if (nerrors > 0) {
+        arg_print_errors(stdout, end, progname);
+
+        printf("Try \"%s --help\" for more information.\n",progname);
+
+        exitcode = 1;
+        goto exit;
+    }
+
+    // sanitize neighborhood parameter
+    if (neighbors->ival[0] != GC_N8 && neighbors->ival[0] != GC_N4) {
+        cerr << "Error: Unsupported neighborhood " << neighbors->ival[0] << endl;
+
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (threads->ival[0] < 1) {
+        cerr << "Error: At least one thread is needed" << endl;
+
+        exitcode = 1;
+        goto exit;
+    }
+    setNumThreads(threads->ival[0]);
+
+    if (check->count > 0) {
+        RNG rng;
+        exitcode = checkMaxFlow<GC_N4>(rng) + checkMaxFlow<GC_N8>(rng) > 0 ? 1 : 0;
+        goto exit;
+    }
+
+    for (int i = 0; i < grids->count; i++) {
+        if (grids->ival[i] < 8) {
+            cerr << "Error: Synthetic images must be at least 8 pixels wide" << endl;
+
+            exitcode = 1;
+            goto exit;
+        }
+    }
+
+    for (int i = 0; i < infiles->count; i++) {
+        Mat image = imread(infiles->filename[i], CV_LOAD_IMAGE_COLOR);
+        if (image.empty()) {
+            cerr << "Error: Cannot read '" << infiles->filename[i] << "'" << endl;
+
+            exitcode = 1;
+            goto exit;
+        }
+        if (sweep->count > 0) {
+            benchmarkThreads(infiles->basename[i], image, iterations->ival[0], neighbors->ival[0]);
+            continue;
+        }
+        benchmark(infiles->basename[i], image, Mat(), iterations->ival[0], neighbors->ival[0], solverSettings());
+        benchmark(infiles->basename[i], image, Mat(), iterations->ival[0], neighbors->ival[0], modelSettings());
+        benchmark(infiles->basename[i], image, Mat(), iterations->ival[0], neighbors->ival[0], superpixelSettings());
+        benchmarkReuse(infiles->basename[i], image, iterations->ival[0], neighbors->ival[0]);
+    }
+
+    for (int i = 0; i < (grids->count > 0 ? grids->count : 3); i++) {
+        Mat truth;
+        Mat image = syntheticImage(grids->count > 0 ? grids->ival[i] : DEFAULT_GRIDS[i], truth);
+
+        if (sweep->count > 0) {
+            benchmarkThreads("synthetic", image, iterations->ival[0], neighbors->ival[0]);
+            continue;
+        }
+        benchmark("synthetic", image, truth, iterations->ival[0], neighbors->ival[0], solverSettings());
+        benchmark("synthetic", image, truth, iterations->ival[0], neighbors->ival[0], modelSettings());
+        benchmark("synthetic", image, truth, iterations->ival[0], neighbors->ival[0], superpixelSettings());
+        benchmarkReuse("synthetic", image, iterations->ival[0], neighbors->ival[0]);
+    }
+
+    exit:
+    // deallocate each non-null entry in argtable[]
+    arg_freetable(argtable,sizeof(argtable)/sizeof(argtable[0]));
+
+    return exitcode;
+}
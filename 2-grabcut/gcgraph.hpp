@@ -52,8 +52,27 @@ public:
     int addVtx();
     void addEdges(int i, int j, TWeight w, TWeight revw);
     void addTermWeights(int i, TWeight sourceW, TWeight sinkW);
-    TWeight maxFlow();
+
+    // Replaces the terminal weights of a vertex after maxFlow(). The change is
+    // applied to the residual graph, so the flow of the previous run stays
+    // valid and maxFlow(true) only has to continue from the changed vertices.
+    void updateTermWeights(int i, TWeight sourceW, TWeight sinkW);
+
+    // If reuseTrees is set, the search trees and the flow of the previous run
+    // are kept and only the vertices given to updateTermWeights() are
+    // activated (dynamic graph cut of Kohli and Torr). If there is more than
+    // one minimum cut, the segmentation may differ from a new run.
+    double maxFlow(bool reuseTrees = false);
     bool inSourceSegment(int i);
+
+    // Stores the current capacities of all edges. Has to be called after the
+    // last addEdges() and before the first maxFlow() to use reset().
+    void saveCapacities();
+
+    // Restores the saved edge capacities and removes all terminal weights and
+    // the flow. The vertices and edges are kept, so the graph can be solved
+    // again with new terminal weights.
+    void reset();
 private:
     class Vtx
     {
@@ -73,16 +92,27 @@ private:
         int next;
         TWeight weight;
     };
+    class TLink
+    {
+    public:
+        TWeight source;
+        TWeight sink;
+    };
 
     std::vector<Vtx> vtcs;
     std::vector<Edge> edges;
-    TWeight flow;
+    std::vector<TWeight> capacities;
+    std::vector<TLink> tlinks;    // terminal weights as given by the user
+    std::vector<int> changed;     // vertices updated since the last maxFlow()
+    double flow;                  // exact for integer capacities
+    int curr_ts;
 };
 
 template <class TWeight>
 GCGraph<TWeight>::GCGraph()
 {
     flow = 0;
+    curr_ts = 0;
 }
 template <class TWeight>
 GCGraph<TWeight>::GCGraph(unsigned int vtxCount, unsigned int edgeCount)
@@ -97,8 +127,10 @@ template <class TWeight>
 void GCGraph<TWeight>::create(unsigned int vtxCount, unsigned int edgeCount)
 {
     vtcs.reserve(vtxCount);
+    tlinks.reserve(vtxCount);
     edges.reserve(edgeCount + 2);
     flow = 0;
+    curr_ts = 0;
 }
 
 template <class TWeight>
@@ -107,6 +139,9 @@ int GCGraph<TWeight>::addVtx()
     Vtx v;
     memset(&v, 0, sizeof(Vtx));
     vtcs.push_back(v);
+    TLink t;
+    t.source = t.sink = 0;
+    tlinks.push_back(t);
     return (int)vtcs.size() - 1;
 }
 
@@ -141,6 +176,9 @@ void GCGraph<TWeight>::addTermWeights(int i, TWeight sourceW, TWeight sinkW)
 {
     CV_Assert(i >= 0 && i < (int)vtcs.size());
 
+    tlinks[i].source += sourceW;
+    tlinks[i].sink += sinkW;
+
     TWeight dw = vtcs[i].weight;
     if (dw > 0) {
         sourceW += dw;
@@ -153,41 +191,194 @@ void GCGraph<TWeight>::addTermWeights(int i, TWeight sourceW, TWeight sinkW)
 }
 
 template <class TWeight>
-TWeight GCGraph<TWeight>::maxFlow()
+void GCGraph<TWeight>::updateTermWeights(int i, TWeight sourceW, TWeight sinkW)
+{
+    CV_Assert(i >= 0 && i < (int)vtcs.size());
+
+    TWeight dSource = sourceW - tlinks[i].source;
+    TWeight dSink = sinkW - tlinks[i].sink;
+    if (dSource == 0 && dSink == 0) {
+        return;
+    }
+
+    // Adding the differences keeps the flow through the vertex. If it exceeds
+    // the new capacity, the residual weight changes its sign, which is the
+    // same as adding a constant to both terminal edges.
+    addTermWeights(i, dSource, dSink);
+    changed.push_back(i);
+}
+
+template <class TWeight>
+double GCGraph<TWeight>::maxFlow(bool reuseTrees)
 {
     const int TERMINAL = -1, ORPHAN = -2;
     Vtx stub, *nilNode = &stub, *first = nilNode, *last = nilNode;
-    int curr_ts = 0;
     stub.next = nilNode;
     Vtx *vtxPtr = &vtcs[0];
     Edge *edgePtr = &edges[0];
 
     std::vector<Vtx*> orphans;
 
-    // initialize the active queue and the graph vertices
-    for (int i = 0; i < (int)vtcs.size(); i++) {
-        Vtx* v = vtxPtr + i;
-        v->ts = 0;
-        if (v->weight != 0) {
-            last = last->next = v;
-            v->dist = 1;
-            v->parent = TERMINAL;
-            v->t = v->weight < 0;
-        } else {
-            v->parent = 0;
+    if (!reuseTrees) {
+        // initialize the active queue and the graph vertices
+        curr_ts = 0;
+        for (int i = 0; i < (int)vtcs.size(); i++) {
+            Vtx* v = vtxPtr + i;
+            v->ts = 0;
+            if (v->weight != 0) {
+                last = last->next = v;
+                v->dist = 1;
+                v->parent = TERMINAL;
+                v->t = v->weight < 0;
+            } else {
+                v->parent = 0;
+            }
+        }
+    } else {
+        // the trees of the previous run are valid except at the changed
+        // vertices: make them roots of the tree given by the sign of their
+        // residual weight, or orphans if it dropped to zero
+        for (size_t i = 0; i < changed.size(); i++) {
+            Vtx* v = vtxPtr + changed[i];
+            if (v->weight != 0) {
+                uchar vt = v->weight < 0;
+                if (v->parent == TERMINAL && v->t == vt) {
+                    continue;
+                }
+                if (v->parent && v->t != vt) {
+                    // the vertex leaves its tree like a freed orphan: the
+                    // neighbors that could grow into it become active and
+                    // its children lose their parent
+                    for (int ei = v->first; ei != 0; ei = edgePtr[ei].next) {
+                        Vtx* u = vtxPtr + edgePtr[ei].dst;
+                        int ej = u->parent;
+                        if (u->t != v->t || !ej) {
+                            continue;
+                        }
+                        if (edgePtr[ei ^ (v->t ^ 1)].weight && !u->next) {
+                            u->next = nilNode;
+                            last = last->next = u;
+                        }
+                        if (ej > 0 && vtxPtr + edgePtr[ej].dst == v) {
+                            orphans.push_back(u);
+                            u->parent = ORPHAN;
+                        }
+                    }
+                }
+                v->parent = TERMINAL;
+                v->t = vt;
+                v->ts = curr_ts;
+                v->dist = 1;
+                if (!v->next) {
+                    v->next = nilNode;
+                    last = last->next = v;
+                }
+            } else if (v->parent == TERMINAL) {
+                orphans.push_back(v);
+                v->parent = ORPHAN;
+            }
         }
     }
+    changed.clear();
     first = first->next;
     last->next = nilNode;
     nilNode->next = 0;
 
-    // run the search-path -> augment-graph -> restore-trees loop
+    // run the restore-trees -> search-path -> augment-graph loop
     for (;;) {
         Vtx* v, *u;
         int e0 = -1, ei = 0, ej = 0;
         TWeight minWeight, weight;
         uchar vt;
 
+        // restore the search trees by finding new parents for the orphans
+        curr_ts++;
+        while (!orphans.empty()) {
+            Vtx* v2 = orphans.back();
+            orphans.pop_back();
+
+            // a changed vertex may have become a root after it was orphaned
+            if (v2->parent != ORPHAN) {
+                continue;
+            }
+
+            int d, minDist = INT_MAX;
+            e0 = 0;
+            vt = v2->t;
+
+            for (ei = v2->first; ei != 0; ei = edgePtr[ei].next) {
+                if (edgePtr[ei ^ (vt ^ 1)].weight == 0) {
+                    continue;
+                }
+                u = vtxPtr + edgePtr[ei].dst;
+                if (u->t != vt || u->parent == 0) {
+                    continue;
+                }
+                // compute the distance to the tree root
+                for (d = 0;;) {
+                    if (u->ts == curr_ts) {
+                        d += u->dist;
+                        break;
+                    }
+                    ej = u->parent;
+                    d++;
+                    if (ej < 0) {
+                        if (ej == ORPHAN) {
+                            d = INT_MAX - 1;
+                        } else {
+                            u->ts = curr_ts;
+                            u->dist = 1;
+                        }
+                        break;
+                    }
+                    u = vtxPtr + edgePtr[ej].dst;
+                }
+
+                // update the distance
+                if (++d < INT_MAX) {
+                    if (d < minDist) {
+                        minDist = d;
+                        e0 = ei;
+                    }
+                    for (u = vtxPtr + edgePtr[ei].dst; u->ts != curr_ts; u = vtxPtr + edgePtr[u->parent].dst) {
+                        u->ts = curr_ts;
+                        u->dist = --d;
+                    }
+                }
+            }
+
+            if ((v2->parent = e0) > 0) {
+                v2->ts = curr_ts;
+                v2->dist = minDist;
+                continue;
+            }
+
+            /* no parent is found */
+            v2->ts = 0;
+            for (ei = v2->first; ei != 0; ei = edgePtr[ei].next) {
+                u = vtxPtr + edgePtr[ei].dst;
+                ej = u->parent;
+                if (u->t != vt || !ej) {
+                    continue;
+                }
+                if (edgePtr[ei ^ (vt ^ 1)].weight && !u->next) {
+                    // the queue is empty if the trees are restored before
+                    // the first search
+                    u->next = nilNode;
+                    if (first == nilNode) {
+                        first = last = u;
+                    } else {
+                        last = last->next = u;
+                    }
+                }
+                if (ej > 0 && vtxPtr + edgePtr[ej].dst == v2) {
+                    orphans.push_back(u);
+                    u->parent = ORPHAN;
+                }
+            }
+        }
+        e0 = -1;
+
         // grow S & T search trees, find an edge connecting them
         while (first != nilNode) {
             v = first;
@@ -277,91 +468,50 @@ TWeight GCGraph<TWeight>::maxFlow()
                 v->parent = ORPHAN;
             }
         }
+    }
+    return flow;
+}
 
-        // restore the search trees by finding new parents for the orphans
-        curr_ts++;
-        while (!orphans.empty()) {
-            Vtx* v2 = orphans.back();
-            orphans.pop_back();
-
-            int d, minDist = INT_MAX;
-            e0 = 0;
-            vt = v2->t;
-
-            for (ei = v2->first; ei != 0; ei = edgePtr[ei].next) {
-                if (edgePtr[ei ^ (vt ^ 1)].weight == 0) {
-                    continue;
-                }
-                u = vtxPtr + edgePtr[ei].dst;
-                if (u->t != vt || u->parent == 0) {
-                    continue;
-                }
-                // compute the distance to the tree root
-                for (d = 0;;) {
-                    if (u->ts == curr_ts) {
-                        d += u->dist;
-                        break;
-                    }
-                    ej = u->parent;
-                    d++;
-                    if (ej < 0) {
-                        if (ej == ORPHAN) {
-                            d = INT_MAX - 1;
-                        } else {
-                            u->ts = curr_ts;
-                            u->dist = 1;
-                        }
-                        break;
-                    }
-                    u = vtxPtr + edgePtr[ej].dst;
-                }
-
-                // update the distance
-                if (++d < INT_MAX) {
-                    if (d < minDist) {
-                        minDist = d;
-                        e0 = ei;
-                    }
-                    for (u = vtxPtr + edgePtr[ei].dst; u->ts != curr_ts; u = vtxPtr + edgePtr[u->parent].dst) {
-                        u->ts = curr_ts;
-                        u->dist = --d;
-                    }
-                }
-            }
+template <class TWeight>
+void GCGraph<TWeight>::saveCapacities()
+{
+    capacities.resize(edges.size());
+    for (size_t i = 0; i < edges.size(); i++) {
+        capacities[i] = edges[i].weight;
+    }
+}
 
-            if ((v2->parent = e0) > 0) {
-                v2->ts = curr_ts;
-                v2->dist = minDist;
-                continue;
-            }
+template <class TWeight>
+void GCGraph<TWeight>::reset()
+{
+    CV_Assert(capacities.size() == edges.size());
 
-            /* no parent is found */
-            v2->ts = 0;
-            for (ei = v2->first; ei != 0; ei = edgePtr[ei].next) {
-                u = vtxPtr + edgePtr[ei].dst;
-                ej = u->parent;
-                if (u->t != vt || !ej) {
-                    continue;
-                }
-                if (edgePtr[ei ^ (vt ^ 1)].weight && !u->next) {
-                    u->next = nilNode;
-                    last = last->next = u;
-                }
-                if (ej > 0 && vtxPtr + edgePtr[ej].dst == v2) {
-                    orphans.push_back(u);
-                    u->parent = ORPHAN;
-                }
-            }
-        }
+    for (size_t i = 0; i < edges.size(); i++) {
+        edges[i].weight = capacities[i];
     }
-    return flow;
+    for (size_t i = 0; i < vtcs.size(); i++) {
+        Vtx &v = vtcs[i];
+        v.next = 0;
+        v.parent = 0;
+        v.ts = 0;
+        v.dist = 0;
+        v.weight = 0;
+        v.t = 0;
+        tlinks[i].source = 0;
+        tlinks[i].sink = 0;
+    }
+    changed.clear();
+    flow = 0;
+    curr_ts = 0;
 }
 
 template <class TWeight>
 bool GCGraph<TWeight>::inSourceSegment(int i)
 {
     CV_Assert(i >= 0 && i < (int)vtcs.size());
-    return vtcs[i].t == 0;
+    // vertices in no tree keep the tree flag of an earlier run, the source
+    // tree alone is a minimum cut
+    return vtcs[i].t == 0 && vtcs[i].parent != 0;
 }
 
 #endif
@@ -0,0 +1,491 @@
+#ifndef CV2_GCGRIDGRAPH_HPP
+#define CV2_GCGRIDGRAPH_HPP
+
+/**
+ * Graph for the max-flow / min-cut calculation on a pixel grid with the same
+ * interface and algorithm (Boykov-Kolmogorov) as GCGraph.
+ *
+ * The neighbors of a vertex follow from its index, so instead of an edge list
+ * only the residual capacities towards the neighbors are stored, one per
+ * direction and vertex. The grid is padded by one vertex on each side whose
+ * capacities are zero, so no neighbor lookup needs a bounds check.
+ *
+ * @param neighbors     GC_N4 or GC_N8
+ */
+template <class TWeight, int neighbors> class GCGridGraph
+{
+public:
+    GCGridGraph();
+    GCGridGraph(int width, int height);
+    void create(int width, int height);
+
+    // Sets the capacities between vertex i and its neighbor j, which must be
+    // adjacent to it on the grid. The vertex index is y * width + x.
+    void addEdges(int i, int j, TWeight w, TWeight revw);
+    void addTermWeights(int i, TWeight sourceW, TWeight sinkW);
+    void updateTermWeights(int i, TWeight sourceW, TWeight sinkW);
+    double maxFlow(bool reuseTrees = false);
+    bool inSourceSegment(int i);
+
+    void saveCapacities();
+    void reset();
+private:
+    class Vtx
+    {
+    public:
+        Vtx *next; // initialized and used in maxFlow() only
+        int ts;
+        int dist;
+        TWeight weight;
+        schar parent; // direction to the parent + 1, TERMINAL or ORPHAN
+        uchar t;
+    };
+    class TLink
+    {
+    public:
+        TWeight source;
+        TWeight sink;
+    };
+
+    // index of the vertex in the padded grid
+    int vtxIdx(int i) const;
+
+    int width, height;
+    int stride;                 // width of the padded grid
+    int offsets[neighbors];     // index difference to the neighbor in each direction
+
+    std::vector<Vtx> vtcs;
+    std::vector<TWeight> caps;  // residual capacity to the neighbor in each direction
+    std::vector<TWeight> capacities;
+    std::vector<TLink> tlinks;
+    std::vector<int> changed;
+    double flow;                // exact for integer capacities
+    int curr_ts;
+};
+
+// Directions are ordered such that d ^ 1 is the opposite of d
+static const int gcGridDx[8] = { -1, 1,  0, 0, -1, 1,  1, -1 };
+static const int gcGridDy[8] = {  0, 0, -1, 1, -1, 1, -1,  1 };
+
+template <class TWeight, int neighbors>
+GCGridGraph<TWeight, neighbors>::GCGridGraph()
+{
+    CV_Assert(neighbors == 4 || neighbors == 8);
+    width = height = stride = 0;
+    flow = 0;
+    curr_ts = 0;
+}
+template <class TWeight, int neighbors>
+GCGridGraph<TWeight, neighbors>::GCGridGraph(int width, int height)
+{
+    CV_Assert(neighbors == 4 || neighbors == 8);
+    create(width, height);
+}
+template <class TWeight, int neighbors>
+void GCGridGraph<TWeight, neighbors>::create(int _width, int _height)
+{
+    CV_Assert(_width > 0 && _height > 0);
+
+    width = _width;
+    height = _height;
+    stride = width + 2;
+    for (int d = 0; d < neighbors; d++) {
+        offsets[d] = gcGridDy[d] * stride + gcGridDx[d];
+    }
+
+    Vtx v;
+    memset(&v, 0, sizeof(Vtx));
+    vtcs.assign(stride * (height + 2), v);
+    caps.assign(vtcs.size() * neighbors, 0);
+
+    TLink t;
+    t.source = t.sink = 0;
+    tlinks.assign(width * height, t);
+
+    capacities.clear();
+    changed.clear();
+    flow = 0;
+    curr_ts = 0;
+}
+
+template <class TWeight, int neighbors>
+inline int GCGridGraph<TWeight, neighbors>::vtxIdx(int i) const
+{
+    // (y + 1) * stride + (x + 1)
+    return i + 2 * (i / width) + stride + 1;
+}
+
+template <class TWeight, int neighbors>
+void GCGridGraph<TWeight, neighbors>::addEdges(int i, int j, TWeight w, TWeight revw)
+{
+    CV_Assert(i >= 0 && i < width * height);
+    CV_Assert(j >= 0 && j < width * height);
+    CV_Assert(w >= 0 && revw >= 0);
+
+    const int dx = j % width - i % width;
+    const int dy = j / width - i / width;
+
+    int d = 0;
+    while (d < neighbors && (gcGridDx[d] != dx || gcGridDy[d] != dy)) {
+        d++;
+    }
+    CV_Assert(d < neighbors);
+
+    caps[vtxIdx(i) * neighbors + d] += w;
+    caps[vtxIdx(j) * neighbors + (d ^ 1)] += revw;
+}
+
+template <class TWeight, int neighbors>
+void GCGridGraph<TWeight, neighbors>::addTermWeights(int i, TWeight sourceW, TWeight sinkW)
+{
+    CV_Assert(i >= 0 && i < width * height);
+
+    tlinks[i].source += sourceW;
+    tlinks[i].sink += sinkW;
+
+    Vtx &v = vtcs[vtxIdx(i)];
+    TWeight dw = v.weight;
+    if (dw > 0) {
+        sourceW += dw;
+    } else {
+        sinkW -= dw;
+    }
+    // add the min(sourceW, sinkW) to flow
+    flow += (sourceW < sinkW) ? sourceW : sinkW;
+    v.weight = sourceW - sinkW;
+}
+
+template <class TWeight, int neighbors>
+void GCGridGraph<TWeight, neighbors>::updateTermWeights(int i, TWeight sourceW, TWeight sinkW)
+{
+    CV_Assert(i >= 0 && i < width * height);
+
+    TWeight dSource = sourceW - tlinks[i].source;
+    TWeight dSink = sinkW - tlinks[i].sink;
+    if (dSource == 0 && dSink == 0) {
+        return;
+    }
+
+    // see GCGraph::updateTermWeights()
+    addTermWeights(i, dSource, dSink);
+    changed.push_back(vtxIdx(i));
+}
+
+template <class TWeight, int neighbors>
+double GCGridGraph<TWeight, neighbors>::maxFlow(bool reuseTrees)
+{
+    const int TERMINAL = -1, ORPHAN = -2;
+    Vtx stub, *nilNode = &stub, *first = nilNode, *last = nilNode;
+    stub.next = nilNode;
+    Vtx *vtxPtr = &vtcs[0];
+    TWeight *capPtr = &caps[0];
+
+    std::vector<Vtx*> orphans;
+
+    // The residual capacity from vertex v to its neighbor in direction d is
+    // capPtr[v * neighbors + d]. The parent of v is v + offsets[v->parent - 1].
+
+    if (!reuseTrees) {
+        // initialize the active queue and the graph vertices
+        curr_ts = 0;
+        for (int i = 0; i < (int)vtcs.size(); i++) {
+            Vtx* v = vtxPtr + i;
+            v->ts = 0;
+            if (v->weight != 0) {
+                last = last->next = v;
+                v->dist = 1;
+                v->parent = TERMINAL;
+                v->t = v->weight < 0;
+            } else {
+                v->parent = 0;
+            }
+        }
+    } else {
+        // see GCGraph::maxFlow()
+        for (size_t i = 0; i < changed.size(); i++) {
+            Vtx* v = vtxPtr + changed[i];
+            if (v->weight != 0) {
+                uchar vt = v->weight < 0;
+                if (v->parent == TERMINAL && v->t == vt) {
+                    continue;
+                }
+                if (v->parent && v->t != vt) {
+                    int iv = changed[i];
+                    for (int d = 0; d < neighbors; d++) {
+                        Vtx* u = v + offsets[d];
+                        int ej = u->parent;
+                        if (u->t != v->t || !ej) {
+                            continue;
+                        }
+                        if ((v->t ? capPtr[iv * neighbors + d] : capPtr[(iv + offsets[d]) * neighbors + (d ^ 1)]) &&
+                            !u->next) {
+                            u->next = nilNode;
+                            last = last->next = u;
+                        }
+                        if (ej > 0 && u + offsets[ej - 1] == v) {
+                            orphans.push_back(u);
+                            u->parent = ORPHAN;
+                        }
+                    }
+                }
+                v->parent = TERMINAL;
+                v->t = vt;
+                v->ts = curr_ts;
+                v->dist = 1;
+                if (!v->next) {
+                    v->next = nilNode;
+                    last = last->next = v;
+                }
+            } else if (v->parent == TERMINAL) {
+                orphans.push_back(v);
+                v->parent = ORPHAN;
+            }
+        }
+    }
+    changed.clear();
+    first = first->next;
+    last->next = nilNode;
+    nilNode->next = 0;
+
+    // run the restore-trees -> search-path -> augment-graph loop
+    for (;;) {
+        Vtx* v, *u;
+        int iv, d, e0 = -1;
+        TWeight minWeight, weight;
+        uchar vt;
+
+        // restore the search trees by finding new parents for the orphans
+        curr_ts++;
+        while (!orphans.empty()) {
+            Vtx* v2 = orphans.back();
+            orphans.pop_back();
+
+            if (v2->parent != ORPHAN) {
+                continue;
+            }
+
+            int dist, minDist = INT_MAX;
+            e0 = 0;
+            vt = v2->t;
+            iv = (int)(v2 - vtxPtr);
+
+            for (d = 0; d < neighbors; d++) {
+                if ((vt ? capPtr[iv * neighbors + d] : capPtr[(iv + offsets[d]) * neighbors + (d ^ 1)]) == 0) {
+                    continue;
+                }
+                u = v2 + offsets[d];
+                if (u->t != vt || u->parent == 0) {
+                    continue;
+                }
+                // compute the distance to the tree root
+                for (dist = 0;;) {
+                    if (u->ts == curr_ts) {
+                        dist += u->dist;
+                        break;
+                    }
+                    int ej = u->parent;
+                    dist++;
+                    if (ej < 0) {
+                        if (ej == ORPHAN) {
+                            dist = INT_MAX - 1;
+                        } else {
+                            u->ts = curr_ts;
+                            u->dist = 1;
+                        }
+                        break;
+                    }
+                    u += offsets[ej - 1];
+                }
+
+                // update the distance
+                if (++dist < INT_MAX) {
+                    if (dist < minDist) {
+                        minDist = dist;
+                        e0 = d + 1;
+                    }
+                    for (u = v2 + offsets[d]; u->ts != curr_ts; u += offsets[u->parent - 1]) {
+                        u->ts = curr_ts;
+                        u->dist = --dist;
+                    }
+                }
+            }
+
+            if ((v2->parent = (schar)e0) > 0) {
+                v2->ts = curr_ts;
+                v2->dist = minDist;
+                continue;
+            }
+
+            /* no parent is found */
+            v2->ts = 0;
+            for (d = 0; d < neighbors; d++) {
+                u = v2 + offsets[d];
+                int ej = u->parent;
+                if (u->t != vt || !ej) {
+                    continue;
+                }
+                if ((vt ? capPtr[iv * neighbors + d] : capPtr[(iv + offsets[d]) * neighbors + (d ^ 1)]) &&
+                    !u->next) {
+                    u->next = nilNode;
+                    if (first == nilNode) {
+                        first = last = u;
+                    } else {
+                        last = last->next = u;
+                    }
+                }
+                if (ej > 0 && u + offsets[ej - 1] == v2) {
+                    orphans.push_back(u);
+                    u->parent = ORPHAN;
+                }
+            }
+        }
+
+        // grow S & T search trees, find an edge (from, dir) connecting them
+        Vtx* from = 0;
+        int dir = 0;
+        while (first != nilNode) {
+            v = first;
+            if (v->parent) {
+                vt = v->t;
+                iv = (int)(v - vtxPtr);
+                for (d = 0; d < neighbors; d++) {
+                    if ((vt ? capPtr[(iv + offsets[d]) * neighbors + (d ^ 1)] : capPtr[iv * neighbors + d]) == 0) {
+                        continue;
+                    }
+                    u = v + offsets[d];
+                    if (!u->parent) {
+                        u->t = vt;
+                        u->parent = (schar)((d ^ 1) + 1);
+                        u->ts = v->ts;
+                        u->dist = v->dist + 1;
+                        if (!u->next) {
+                            u->next = nilNode;
+                            last = last->next = u;
+                        }
+                        continue;
+                    }
+
+                    if (u->t != vt) {
+                        // the edge is directed from the source to the sink tree
+                        from = vt ? u : v;
+                        dir = vt ? d ^ 1 : d;
+                        break;
+                    }
+
+                    if (u->dist > v->dist + 1 && u->ts <= v->ts) {
+                        // reassign the parent
+                        u->parent = (schar)((d ^ 1) + 1);
+                        u->ts = v->ts;
+                        u->dist = v->dist + 1;
+                    }
+                }
+                if (from) {
+                    break;
+                }
+            }
+            // exclude the vertex from the active list
+            first = first->next;
+            v->next = 0;
+        }
+
+        if (!from) {
+            break;
+        }
+
+        Vtx* to = from + offsets[dir];
+        TWeight &cap = capPtr[(from - vtxPtr) * neighbors + dir];
+        TWeight &revCap = capPtr[(to - vtxPtr) * neighbors + (dir ^ 1)];
+
+        // find the minimum edge weight along the path
+        minWeight = cap;
+        assert(minWeight > 0);
+        // k = 1: source tree, k = 0: destination tree
+        for (int k = 1; k >= 0; k--) {
+            for (v = k ? from : to; v->parent > 0; v = u) {
+                d = v->parent - 1;
+                u = v + offsets[d];
+                // source tree: parent -> child, sink tree: child -> parent
+                weight = k ? capPtr[(u - vtxPtr) * neighbors + (d ^ 1)] : capPtr[(v - vtxPtr) * neighbors + d];
+                minWeight = MIN(minWeight, weight);
+                assert(minWeight > 0);
+            }
+            weight = fabs(v->weight);
+            minWeight = MIN(minWeight, weight);
+            assert(minWeight > 0);
+        }
+
+        // modify weights of the edges along the path and collect orphans
+        cap -= minWeight;
+        revCap += minWeight;
+        flow += minWeight;
+
+        // k = 1: source tree, k = 0: destination tree
+        for (int k = 1; k >= 0; k--) {
+            for (v = k ? from : to; v->parent > 0; v = u) {
+                d = v->parent - 1;
+                u = v + offsets[d];
+                TWeight &down = capPtr[(u - vtxPtr) * neighbors + (d ^ 1)];
+                TWeight &up = capPtr[(v - vtxPtr) * neighbors + d];
+                if (k) {
+                    up += minWeight;
+                    down -= minWeight;
+                } else {
+                    down += minWeight;
+                    up -= minWeight;
+                }
+                if ((k ? down : up) == 0) {
+                    orphans.push_back(v);
+                    v->parent = ORPHAN;
+                }
+            }
+
+            v->weight = v->weight + minWeight * (1 - k * 2);
+            if (v->weight == 0) {
+                orphans.push_back(v);
+                v->parent = ORPHAN;
+            }
+        }
+    }
+    return flow;
+}
+
+template <class TWeight, int neighbors>
+void GCGridGraph<TWeight, neighbors>::saveCapacities()
+{
+    capacities = caps;
+}
+
+template <class TWeight, int neighbors>
+void GCGridGraph<TWeight, neighbors>::reset()
+{
+    CV_Assert(capacities.size() == caps.size());
+
+    caps = capacities;
+    for (size_t i = 0; i < vtcs.size(); i++) {
+        Vtx &v = vtcs[i];
+        v.next = 0;
+        v.parent = 0;
+        v.ts = 0;
+        v.dist = 0;
+        v.weight = 0;
+        v.t = 0;
+    }
+    for (size_t i = 0; i < tlinks.size(); i++) {
+        tlinks[i].source = 0;
+        tlinks[i].sink = 0;
+    }
+    changed.clear();
+    flow = 0;
+    curr_ts = 0;
+}
+
+template <class TWeight, int neighbors>
+bool GCGridGraph<TWeight, neighbors>::inSourceSegment(int i)
+{
+    CV_Assert(i >= 0 && i < width * height);
+    // see GCGraph::inSourceSegment()
+    const Vtx &v = vtcs[vtxIdx(i)];
+    return v.t == 0 && v.parent != 0;
+}
+
+#endif // CV2_GCGRIDGRAPH_HPP
@@ -0,0 +1,449 @@
+#ifndef CV2_GCIBFSGRAPH_HPP
+#define CV2_GCIBFSGRAPH_HPP
+
+#include "gcgridgraph.hpp"
+
+/**
+ * Graph for the max-flow / min-cut calculation on a pixel grid that is solved
+ * by incremental breadth-first search (IBFS, Goldberg et al. 2011). It has the
+ * same interface and grid layout as GCGridGraph.
+ *
+ * Like Boykov-Kolmogorov, IBFS grows a source and a sink tree and augments
+ * along the edges between them, but it grows the trees level by level and
+ * keeps them breadth-first: every vertex is labeled with its distance to the
+ * root, and an orphan is first adopted by a vertex on the level above it. Only
+ * if there is none, it is relabeled or leaves its tree. In each pass the tree
+ * with fewer active vertices grows by one level. The algorithm stops as soon
+ * as one of the trees cannot grow anymore.
+ *
+ * The source segment is the set of vertices that can be reached from the
+ * source in the residual graph, which is the same minimum cut as the source
+ * tree of the Boykov-Kolmogorov algorithm.
+ *
+ * @param neighbors     GC_N4 or GC_N8
+ */
+template <class TWeight, int neighbors> class GCIBFSGraph
+{
+public:
+    GCIBFSGraph();
+    GCIBFSGraph(int width, int height);
+    void create(int width, int height);
+
+    void addEdges(int i, int j, TWeight w, TWeight revw);
+    void addTermWeights(int i, TWeight sourceW, TWeight sinkW);
+    void updateTermWeights(int i, TWeight sourceW, TWeight sinkW);
+
+    // If reuseTrees is set, the flow of the previous run is kept and only the
+    // trees are grown again.
+    double maxFlow(bool reuseTrees = false);
+    bool inSourceSegment(int i);
+
+    void saveCapacities();
+    void reset();
+private:
+    class Vtx
+    {
+    public:
+        int label;      // distance to the root of the tree
+        TWeight weight;
+        schar parent;   // direction to the parent + 1, TERMINAL or ORPHAN
+        uchar t;
+        uchar active;   // bit t is set if the vertex is queued in tree t
+    };
+    class TLink
+    {
+    public:
+        TWeight source;
+        TWeight sink;
+    };
+
+    // index of the vertex in the padded grid
+    int vtxIdx(int i) const;
+
+    // residual capacity of the edge between v and its neighbor in direction d
+    // in the direction of tree t, i.e. from the parent to the child
+    TWeight treeCap(int v, int d, int t) const;
+
+    void enqueue(int v, int t);
+    void augment(int from, int dir, std::vector<int> &orphans);
+    void adopt(std::vector<int> &orphans);
+
+    int width, height;
+    int stride;                 // width of the padded grid
+    int offsets[neighbors];     // index difference to the neighbor in each direction
+
+    std::vector<Vtx> vtcs;
+    std::vector<TWeight> caps;  // residual capacity to the neighbor in each direction
+    std::vector<TWeight> capacities;
+    std::vector<TLink> tlinks;
+    std::vector<int> queues[2]; // active vertices of the source and sink tree
+    std::vector<uchar> source;
+    double flow;                // exact for integer capacities
+};
+
+template <class TWeight, int neighbors>
+GCIBFSGraph<TWeight, neighbors>::GCIBFSGraph()
+{
+    CV_Assert(neighbors == 4 || neighbors == 8);
+    width = height = stride = 0;
+    flow = 0;
+}
+template <class TWeight, int neighbors>
+GCIBFSGraph<TWeight, neighbors>::GCIBFSGraph(int width, int height)
+{
+    CV_Assert(neighbors == 4 || neighbors == 8);
+    create(width, height);
+}
+template <class TWeight, int neighbors>
+void GCIBFSGraph<TWeight, neighbors>::create(int _width, int _height)
+{
+    CV_Assert(_width > 0 && _height > 0);
+
+    width = _width;
+    height = _height;
+    stride = width + 2;
+    for (int d = 0; d < neighbors; d++) {
+        offsets[d] = gcGridDy[d] * stride + gcGridDx[d];
+    }
+
+    Vtx v;
+    memset(&v, 0, sizeof(Vtx));
+    vtcs.assign(stride * (height + 2), v);
+    caps.assign(vtcs.size() * neighbors, 0);
+    source.assign(vtcs.size(), 0);
+
+    TLink t;
+    t.source = t.sink = 0;
+    tlinks.assign(width * height, t);
+
+    capacities.clear();
+    flow = 0;
+}
+
+template <class TWeight, int neighbors>
+inline int GCIBFSGraph<TWeight, neighbors>::vtxIdx(int i) const
+{
+    // (y + 1) * stride + (x + 1)
+    return i + 2 * (i / width) + stride + 1;
+}
+
+template <class TWeight, int neighbors>
+inline TWeight GCIBFSGraph<TWeight, neighbors>::treeCap(int v, int d, int t) const
+{
+    return t ? caps[(v + offsets[d]) * neighbors + (d ^ 1)] : caps[v * neighbors + d];
+}
+
+template <class TWeight, int neighbors>
+void GCIBFSGraph<TWeight, neighbors>::addEdges(int i, int j, TWeight w, TWeight revw)
+{
+    CV_Assert(i >= 0 && i < width * height);
+    CV_Assert(j >= 0 && j < width * height);
+    CV_Assert(w >= 0 && revw >= 0);
+
+    const int dx = j % width - i % width;
+    const int dy = j / width - i / width;
+
+    int d = 0;
+    while (d < neighbors && (gcGridDx[d] != dx || gcGridDy[d] != dy)) {
+        d++;
+    }
+    CV_Assert(d < neighbors);
+
+    caps[vtxIdx(i) * neighbors + d] += w;
+    caps[vtxIdx(j) * neighbors + (d ^ 1)] += revw;
+}
+
+template <class TWeight, int neighbors>
+void GCIBFSGraph<TWeight, neighbors>::addTermWeights(int i, TWeight sourceW, TWeight sinkW)
+{
+    CV_Assert(i >= 0 && i < width * height);
+
+    tlinks[i].source += sourceW;
+    tlinks[i].sink += sinkW;
+
+    Vtx &v = vtcs[vtxIdx(i)];
+    TWeight dw = v.weight;
+    if (dw > 0) {
+        sourceW += dw;
+    } else {
+        sinkW -= dw;
+    }
+    // add the min(sourceW, sinkW) to flow
+    flow += (sourceW < sinkW) ? sourceW : sinkW;
+    v.weight = sourceW - sinkW;
+}
+
+template <class TWeight, int neighbors>
+void GCIBFSGraph<TWeight, neighbors>::updateTermWeights(int i, TWeight sourceW, TWeight sinkW)
+{
+    CV_Assert(i >= 0 && i < width * height);
+
+    // the trees are grown from scratch in each run, so the residual graph
+    // only has to stay valid, see GCGraph::updateTermWeights()
+    addTermWeights(i, sourceW - tlinks[i].source, sinkW - tlinks[i].sink);
+}
+
+template <class TWeight, int neighbors>
+inline void GCIBFSGraph<TWeight, neighbors>::enqueue(int v, int t)
+{
+    if (!(vtcs[v].active & (1 << t))) {
+        vtcs[v].active |= (uchar)(1 << t);
+        queues[t].push_back(v);
+    }
+}
+
+template <class TWeight, int neighbors>
+void GCIBFSGraph<TWeight, neighbors>::augment(int from, int dir, std::vector<int> &orphans)
+{
+    const int TERMINAL = -1, ORPHAN = -2;
+    (void) TERMINAL; // only checked by the assertions
+    Vtx *vtxPtr = &vtcs[0];
+    TWeight *capPtr = &caps[0];
+
+    const int to = from + offsets[dir];
+    TWeight &cap = capPtr[from * neighbors + dir];
+    TWeight &revCap = capPtr[to * neighbors + (dir ^ 1)];
+
+    // find the minimum edge weight along the path
+    TWeight minWeight = cap;
+    assert(minWeight > 0);
+    // k = 1: source tree, k = 0: destination tree
+    for (int k = 1; k >= 0; k--) {
+        int v = k ? from : to;
+        for (; vtxPtr[v].parent > 0; v += offsets[vtxPtr[v].parent - 1]) {
+            int d = vtxPtr[v].parent - 1;
+            // source tree: parent -> child, sink tree: child -> parent
+            TWeight weight = k ? capPtr[(v + offsets[d]) * neighbors + (d ^ 1)] : capPtr[v * neighbors + d];
+            minWeight = MIN(minWeight, weight);
+            assert(minWeight > 0);
+        }
+        assert(vtxPtr[v].parent == TERMINAL);
+        TWeight weight = fabs(vtxPtr[v].weight);
+        minWeight = MIN(minWeight, weight);
+        assert(minWeight > 0);
+    }
+
+    // modify weights of the edges along the path and collect orphans
+    cap -= minWeight;
+    revCap += minWeight;
+    flow += minWeight;
+
+    // k = 1: source tree, k = 0: destination tree
+    for (int k = 1; k >= 0; k--) {
+        int v = k ? from : to;
+        for (int u; vtxPtr[v].parent > 0; v = u) {
+            int d = vtxPtr[v].parent - 1;
+            u = v + offsets[d];
+            TWeight &down = capPtr[u * neighbors + (d ^ 1)];
+            TWeight &up = capPtr[v * neighbors + d];
+            if (k) {
+                up += minWeight;
+                down -= minWeight;
+            } else {
+                down += minWeight;
+                up -= minWeight;
+            }
+            if ((k ? down : up) == 0) {
+                orphans.push_back(v);
+                vtxPtr[v].parent = ORPHAN;
+            }
+        }
+
+        vtxPtr[v].weight = vtxPtr[v].weight + minWeight * (1 - k * 2);
+        if (vtxPtr[v].weight == 0) {
+            orphans.push_back(v);
+            vtxPtr[v].parent = ORPHAN;
+        }
+    }
+}
+
+template <class TWeight, int neighbors>
+void GCIBFSGraph<TWeight, neighbors>::adopt(std::vector<int> &orphans)
+{
+    const int ORPHAN = -2;
+    Vtx *vtxPtr = &vtcs[0];
+
+    // The label of a child is always the label of its parent + 1, so the
+    // labels decrease towards the root and a vertex can never be adopted by
+    // one of its descendants.
+    while (!orphans.empty()) {
+        const int v = orphans.back();
+        orphans.pop_back();
+
+        Vtx &vtx = vtxPtr[v];
+        if (vtx.parent != ORPHAN) {
+            continue;
+        }
+        const uchar vt = vtx.t;
+
+        // look for a parent on the level above, otherwise take the lowest
+        // level that is not below the orphan
+        int parent = 0, minLabel = INT_MAX;
+        for (int d = 0; d < neighbors; d++) {
+            const Vtx &u = vtxPtr[v + offsets[d]];
+            if (u.t != vt || u.parent == 0 || u.label > vtx.label || treeCap(v + offsets[d], d ^ 1, vt) == 0) {
+                continue;
+            }
+            if (u.label < minLabel) {
+                minLabel = u.label;
+                parent = d + 1;
+                if (minLabel == vtx.label - 1) {
+                    break;
+                }
+            }
+        }
+
+        if (parent && minLabel == vtx.label - 1) {
+            vtx.parent = (schar)parent;
+            continue;
+        }
+
+        // the children lose their parent in any case
+        for (int d = 0; d < neighbors; d++) {
+            Vtx &u = vtxPtr[v + offsets[d]];
+            if (u.t == vt && u.parent > 0 && v + offsets[d] + offsets[u.parent - 1] == v) {
+                orphans.push_back(v + offsets[d]);
+                u.parent = ORPHAN;
+            }
+        }
+
+        if (parent) {
+            // relabel
+            vtx.parent = (schar)parent;
+            vtx.label = minLabel + 1;
+            continue;
+        }
+
+        // no parent is found, the neighbors that can reach the vertex have to
+        // grow their tree again
+        vtx.parent = 0;
+        for (int d = 0; d < neighbors; d++) {
+            const Vtx &u = vtxPtr[v + offsets[d]];
+            if (u.t == vt && u.parent != 0 && treeCap(v + offsets[d], d ^ 1, vt) != 0) {
+                enqueue(v + offsets[d], vt);
+            }
+        }
+    }
+}
+
+template <class TWeight, int neighbors>
+double GCIBFSGraph<TWeight, neighbors>::maxFlow(bool reuseTrees)
+{
+    const int TERMINAL = -1;
+    Vtx *vtxPtr = &vtcs[0];
+
+    // the residual graph of the previous run stays valid when the terminal
+    // weights change, so there is nothing to restore for reuseTrees
+    (void) reuseTrees;
+
+    queues[0].clear();
+    queues[1].clear();
+    for (int i = 0; i < (int)vtcs.size(); i++) {
+        Vtx &v = vtxPtr[i];
+        v.active = 0;
+        if (v.weight != 0) {
+            v.parent = TERMINAL;
+            v.t = v.weight < 0;
+            v.label = 1;
+            enqueue(i, v.t);
+        } else {
+            v.parent = 0;
+        }
+    }
+
+    std::vector<int> current, orphans;
+
+    // grow the smaller tree by one level until one of them is complete
+    while (!queues[0].empty() && !queues[1].empty()) {
+        const int t = queues[0].size() > queues[1].size();
+        current.swap(queues[t]);
+        queues[t].clear();
+
+        for (size_t i = 0; i < current.size(); i++) {
+            const int v = current[i];
+            vtxPtr[v].active &= (uchar)~(1 << t);
+
+            for (int d = 0; d < neighbors && vtxPtr[v].parent != 0 && vtxPtr[v].t == t;) {
+                if (treeCap(v, d, t) == 0) {
+                    d++;
+                    continue;
+                }
+                const int u = v + offsets[d];
+                Vtx &vu = vtxPtr[u];
+                if (!vu.parent) {
+                    vu.t = (uchar)t;
+                    vu.parent = (schar)((d ^ 1) + 1);
+                    vu.label = vtxPtr[v].label + 1;
+                    enqueue(u, t);
+                    d++;
+                } else if (vu.t == t) {
+                    d++;
+                } else {
+                    // the edge is directed from the source to the sink tree,
+                    // augment until it is saturated or v leaves its tree
+                    augment(t ? u : v, t ? d ^ 1 : d, orphans);
+                    adopt(orphans);
+                }
+            }
+        }
+    }
+
+    // mark the vertices that can be reached from the source
+    std::vector<int> &stack = current;
+    stack.clear();
+    for (int i = 0; i < (int)vtcs.size(); i++) {
+        source[i] = vtxPtr[i].weight > 0;
+        if (source[i]) {
+            stack.push_back(i);
+        }
+    }
+    while (!stack.empty()) {
+        const int v = stack.back();
+        stack.pop_back();
+        for (int d = 0; d < neighbors; d++) {
+            const int u = v + offsets[d];
+            if (!source[u] && caps[v * neighbors + d] > 0) {
+                source[u] = 1;
+                stack.push_back(u);
+            }
+        }
+    }
+
+    return flow;
+}
+
+template <class TWeight, int neighbors>
+void GCIBFSGraph<TWeight, neighbors>::saveCapacities()
+{
+    capacities = caps;
+}
+
+template <class TWeight, int neighbors>
+void GCIBFSGraph<TWeight, neighbors>::reset()
+{
+    CV_Assert(capacities.size() == caps.size());
+
+    caps = capacities;
+    for (size_t i = 0; i < vtcs.size(); i++) {
+        Vtx &v = vtcs[i];
+        v.label = 0;
+        v.weight = 0;
+        v.parent = 0;
+        v.t = 0;
+        v.active = 0;
+    }
+    for (size_t i = 0; i < tlinks.size(); i++) {
+        tlinks[i].source = 0;
+        tlinks[i].sink = 0;
+    }
+    flow = 0;
+}
+
+template <class TWeight, int neighbors>
+bool GCIBFSGraph<TWeight, neighbors>::inSourceSegment(int i)
+{
+    CV_Assert(i >= 0 && i < width * height);
+    return source[vtxIdx(i)] != 0;
+}
+
+#endif // CV2_GCIBFSGRAPH_HPP
@@ -0,0 +1,511 @@
+#ifndef CV2_GCPUSHRELABEL_HPP
+#define CV2_GCPUSHRELABEL_HPP
+
+#include "gcgridgraph.hpp"
+
+/**
+ * Graph for the max-flow / min-cut calculation on a pixel grid that is solved
+ * by a synchronous push-relabel algorithm on all cores. It has the same
+ * interface and grid layout as GCGridGraph.
+ *
+ * Each sweep consists of three parallel passes over the rows: every active
+ * vertex pushes its excess along the admissible edges, every vertex collects
+ * the flow pushed towards it and every vertex that is still active without an
+ * admissible edge is relabeled. A vertex only writes its own data in each
+ * pass, so the passes need no locks and the result does not depend on the
+ * number of threads. The labels are recomputed regularly by a breadth-first
+ * search from the sink that runs on bands of rows in parallel.
+ *
+ * The source segment is the set of vertices that can be reached from the
+ * remaining excess, which is the same minimum cut as the source tree of the
+ * Boykov-Kolmogorov algorithm.
+ *
+ * @param neighbors     GC_N4 or GC_N8
+ */
+template <class TWeight, int neighbors> class GCPushRelabelGraph
+{
+public:
+    GCPushRelabelGraph();
+    GCPushRelabelGraph(int width, int height);
+    void create(int width, int height);
+
+    void addEdges(int i, int j, TWeight w, TWeight revw);
+    void addTermWeights(int i, TWeight sourceW, TWeight sinkW);
+    void updateTermWeights(int i, TWeight sourceW, TWeight sinkW);
+
+    // If reuseTrees is set, the preflow of the previous run is kept and only
+    // the labels are recomputed.
+    double maxFlow(bool reuseTrees = false);
+    bool inSourceSegment(int i);
+
+    void saveCapacities();
+    void reset();
+private:
+    class Push;
+    class Gather;
+    class Relabel;
+    class Search;
+
+    // index of the vertex in the padded grid
+    int vtxIdx(int i) const;
+
+    // Breadth-first search over the residual graph. If toSink is set, the
+    // labels are set to the distance to the sink, otherwise the vertices
+    // reachable from the excess are marked as source segment. Returns the
+    // number of active vertices.
+    int search(bool toSink);
+
+    int width, height;
+    int stride;                 // width of the padded grid
+    int offsets[neighbors];     // index difference to the neighbor in each direction
+    int bandRows;               // rows per band of the parallel search
+
+    std::vector<TWeight> caps;      // residual capacity to the neighbor in each direction
+    std::vector<TWeight> pushed;    // flow pushed to the neighbor in the current sweep
+    std::vector<TWeight> excess;    // excess if positive, residual capacity to the sink if negative
+    std::vector<int> labels, newLabels;
+    std::vector<uchar> source;
+    std::vector<int> rowCounts;
+
+    std::vector<TWeight> capacities;
+    std::vector<TWeight> sourceWeights;
+    std::vector<TWeight> sinkWeights;
+    double flow;                // exact for integer capacities
+};
+
+// label of vertices that cannot reach the sink
+static const int gcUnreachable = INT_MAX;
+
+// number of sweeps between two global relabelings
+static const int gcRelabelInterval = 16;
+
+template <class TWeight, int neighbors>
+class GCPushRelabelGraph<TWeight, neighbors>::Push : public cv::ParallelLoopBody
+{
+  public:
+    Push(GCPushRelabelGraph &_graph) :
+        graph(_graph)
+    {}
+
+    void operator()(const cv::Range &rows) const
+    {
+        TWeight *caps = &graph.caps[0];
+        TWeight *pushed = &graph.pushed[0];
+        const int *labels = &graph.labels[0];
+
+        for (int row = rows.start; row < rows.end; row++) {
+            const int end = row * graph.stride + graph.width + 1;
+            for (int v = row * graph.stride + 1; v < end; v++) {
+                TWeight e = graph.excess[v];
+                const int h = labels[v];
+                if (e <= 0 || h == gcUnreachable) {
+                    continue;
+                }
+                for (int d = 0; d < neighbors && e > 0; d++) {
+                    TWeight &cap = caps[v * neighbors + d];
+                    if (cap > 0 && labels[v + graph.offsets[d]] == h - 1) {
+                        TWeight f = std::min(e, cap);
+                        cap -= f;
+                        pushed[v * neighbors + d] = f;
+                        e -= f;
+                    }
+                }
+                graph.excess[v] = e;
+            }
+        }
+    }
+
+  private:
+    GCPushRelabelGraph &graph;
+};
+
+template <class TWeight, int neighbors>
+class GCPushRelabelGraph<TWeight, neighbors>::Gather : public cv::ParallelLoopBody
+{
+  public:
+    Gather(GCPushRelabelGraph &_graph) :
+        graph(_graph)
+    {}
+
+    void operator()(const cv::Range &rows) const
+    {
+        TWeight *caps = &graph.caps[0];
+        TWeight *pushed = &graph.pushed[0];
+
+        for (int row = rows.start; row < rows.end; row++) {
+            const int end = row * graph.stride + graph.width + 1;
+            for (int u = row * graph.stride + 1; u < end; u++) {
+                for (int d = 0; d < neighbors; d++) {
+                    // only this vertex reads the flow pushed towards it
+                    TWeight &f = pushed[(u + graph.offsets[d]) * neighbors + (d ^ 1)];
+                    if (f > 0) {
+                        caps[u * neighbors + d] += f;
+                        graph.excess[u] += f;
+                        f = 0;
+                    }
+                }
+            }
+        }
+    }
+
+  private:
+    GCPushRelabelGraph &graph;
+};
+
+template <class TWeight, int neighbors>
+class GCPushRelabelGraph<TWeight, neighbors>::Relabel : public cv::ParallelLoopBody
+{
+  public:
+    Relabel(GCPushRelabelGraph &_graph) :
+        graph(_graph)
+    {}
+
+    void operator()(const cv::Range &rows) const
+    {
+        const TWeight *caps = &graph.caps[0];
+        const int *labels = &graph.labels[0];
+        int *newLabels = &graph.newLabels[0];
+
+        for (int row = rows.start; row < rows.end; row++) {
+            const int end = row * graph.stride + graph.width + 1;
+            int active = 0;
+            for (int v = row * graph.stride + 1; v < end; v++) {
+                int h = labels[v];
+                if (graph.excess[v] > 0 && h != gcUnreachable) {
+                    int minLabel = gcUnreachable;
+                    for (int d = 0; d < neighbors; d++) {
+                        if (caps[v * neighbors + d] > 0) {
+                            minLabel = std::min(minLabel, labels[v + graph.offsets[d]]);
+                        }
+                    }
+                    // relabel only if there is no admissible edge left
+                    if (minLabel != h - 1) {
+                        h = minLabel == gcUnreachable ? gcUnreachable : minLabel + 1;
+                    }
+                    active += h != gcUnreachable;
+                }
+                newLabels[v] = h;
+            }
+            graph.rowCounts[row] = active;
+        }
+    }
+
+  private:
+    GCPushRelabelGraph &graph;
+};
+
+/**
+ * One level of the breadth-first search. Each band of rows expands its own
+ * frontier and only labels its own vertices. Vertices found in a neighboring
+ * band are passed on to it and labeled by it in the next level.
+ */
+template <class TWeight, int neighbors>
+class GCPushRelabelGraph<TWeight, neighbors>::Search : public cv::ParallelLoopBody
+{
+  public:
+    Search(GCPushRelabelGraph &_graph, bool _toSink, int _level,
+           std::vector<std::vector<int> > &_frontiers,
+           std::vector<std::vector<int> > &_outbox, const std::vector<std::vector<int> > &_inbox,
+           std::vector<int> &_counts) :
+        graph(_graph), toSink(_toSink), level(_level), frontiers(_frontiers), outbox(_outbox), inbox(_inbox),
+        counts(_counts)
+    {}
+
+    void operator()(const cv::Range &bands) const
+    {
+        const TWeight *caps = &graph.caps[0];
+        const int bandCount = (int)frontiers.size();
+
+        for (int b = bands.start; b < bands.end; b++) {
+            const int first = (1 + b * graph.bandRows) * graph.stride;
+            const int last = (1 + std::min(graph.height, (b + 1) * graph.bandRows)) * graph.stride;
+
+            std::vector<int> &frontier = frontiers[b];
+            std::vector<int> next;
+            outbox[2 * b].clear();
+            outbox[2 * b + 1].clear();
+
+            // vertices found by the neighboring bands in the last level
+            if (b > 0) {
+                accept(inbox[2 * (b - 1) + 1], frontier);
+            }
+            if (b < bandCount - 1) {
+                accept(inbox[2 * (b + 1)], frontier);
+            }
+
+            for (size_t k = 0; k < frontier.size(); k++) {
+                const int u = frontier[k];
+                for (int d = 0; d < neighbors; d++) {
+                    const int v = u + graph.offsets[d];
+                    // towards the sink the residual edge must point to u
+                    if ((toSink ? caps[v * neighbors + (d ^ 1)] : caps[u * neighbors + d]) <= 0) {
+                        continue;
+                    }
+                    if (v < first) {
+                        outbox[2 * b].push_back(v);
+                    } else if (v >= last) {
+                        outbox[2 * b + 1].push_back(v);
+                    } else if (visit(v)) {
+                        next.push_back(v);
+                    }
+                }
+            }
+
+            frontier.swap(next);
+            counts[b] = (int)(frontier.size() + outbox[2 * b].size() + outbox[2 * b + 1].size());
+        }
+    }
+
+  private:
+    // marks v as found in the next level, returns false if it was found before
+    bool visit(int v) const
+    {
+        if (toSink) {
+            if (graph.labels[v] != gcUnreachable) {
+                return false;
+            }
+            graph.labels[v] = level + 1;
+        } else {
+            if (graph.source[v]) {
+                return false;
+            }
+            graph.source[v] = 1;
+        }
+        return true;
+    }
+
+    void accept(const std::vector<int> &found, std::vector<int> &frontier) const
+    {
+        for (size_t k = 0; k < found.size(); k++) {
+            // the inbox was filled at the last level, the vertex is part of
+            // the current one
+            const int v = found[k];
+            if (toSink ? graph.labels[v] == gcUnreachable : !graph.source[v]) {
+                if (toSink) {
+                    graph.labels[v] = level;
+                } else {
+                    graph.source[v] = 1;
+                }
+                frontier.push_back(v);
+            }
+        }
+    }
+
+    GCPushRelabelGraph &graph;
+    const bool toSink;
+    const int level;
+    std::vector<std::vector<int> > &frontiers;
+    std::vector<std::vector<int> > &outbox;
+    const std::vector<std::vector<int> > &inbox;
+    std::vector<int> &counts;
+};
+
+template <class TWeight, int neighbors>
+GCPushRelabelGraph<TWeight, neighbors>::GCPushRelabelGraph()
+{
+    CV_Assert(neighbors == 4 || neighbors == 8);
+    width = height = stride = bandRows = 0;
+    flow = 0;
+}
+template <class TWeight, int neighbors>
+GCPushRelabelGraph<TWeight, neighbors>::GCPushRelabelGraph(int width, int height)
+{
+    CV_Assert(neighbors == 4 || neighbors == 8);
+    create(width, height);
+}
+template <class TWeight, int neighbors>
+void GCPushRelabelGraph<TWeight, neighbors>::create(int _width, int _height)
+{
+    CV_Assert(_width > 0 && _height > 0);
+
+    width = _width;
+    height = _height;
+    stride = width + 2;
+    for (int d = 0; d < neighbors; d++) {
+        offsets[d] = gcGridDy[d] * stride + gcGridDx[d];
+    }
+    // a few bands per thread to balance the load of the search
+    bandRows = std::max(8, height / (4 * std::max(1, cv::getNumThreads())));
+
+    const int vtxCount = stride * (height + 2);
+    caps.assign(vtxCount * neighbors, 0);
+    pushed.assign(vtxCount * neighbors, 0);
+    excess.assign(vtxCount, 0);
+    labels.assign(vtxCount, gcUnreachable);
+    newLabels.assign(vtxCount, gcUnreachable);
+    source.assign(vtxCount, 0);
+    rowCounts.assign(height + 2, 0);
+
+    capacities.clear();
+    sourceWeights.assign(width * height, 0);
+    sinkWeights.assign(width * height, 0);
+    flow = 0;
+}
+
+template <class TWeight, int neighbors>
+inline int GCPushRelabelGraph<TWeight, neighbors>::vtxIdx(int i) const
+{
+    // (y + 1) * stride + (x + 1)
+    return i + 2 * (i / width) + stride + 1;
+}
+
+template <class TWeight, int neighbors>
+void GCPushRelabelGraph<TWeight, neighbors>::addEdges(int i, int j, TWeight w, TWeight revw)
+{
+    CV_Assert(i >= 0 && i < width * height);
+    CV_Assert(j >= 0 && j < width * height);
+    CV_Assert(w >= 0 && revw >= 0);
+
+    const int dx = j % width - i % width;
+    const int dy = j / width - i / width;
+
+    int d = 0;
+    while (d < neighbors && (gcGridDx[d] != dx || gcGridDy[d] != dy)) {
+        d++;
+    }
+    CV_Assert(d < neighbors);
+
+    caps[vtxIdx(i) * neighbors + d] += w;
+    caps[vtxIdx(j) * neighbors + (d ^ 1)] += revw;
+}
+
+template <class TWeight, int neighbors>
+void GCPushRelabelGraph<TWeight, neighbors>::addTermWeights(int i, TWeight sourceW, TWeight sinkW)
+{
+    CV_Assert(i >= 0 && i < width * height);
+
+    sourceWeights[i] += sourceW;
+    sinkWeights[i] += sinkW;
+
+    // the flow from the source to the sink through the vertex alone is
+    // implicit, the source edge is saturated at once
+    excess[vtxIdx(i)] += sourceW - sinkW;
+}
+
+template <class TWeight, int neighbors>
+void GCPushRelabelGraph<TWeight, neighbors>::updateTermWeights(int i, TWeight sourceW, TWeight sinkW)
+{
+    CV_Assert(i >= 0 && i < width * height);
+
+    // the labels are recomputed by maxFlow(), the preflow stays valid
+    addTermWeights(i, sourceW - sourceWeights[i], sinkW - sinkWeights[i]);
+}
+
+template <class TWeight, int neighbors>
+int GCPushRelabelGraph<TWeight, neighbors>::search(bool toSink)
+{
+    const int bandCount = (height + bandRows - 1) / bandRows;
+
+    std::vector<std::vector<int> > frontiers(bandCount);
+    std::vector<std::vector<int> > outboxes[2];
+    outboxes[0].resize(2 * bandCount);
+    outboxes[1].resize(2 * bandCount);
+    std::vector<int> counts(bandCount);
+
+    if (toSink) {
+        std::fill(labels.begin(), labels.end(), gcUnreachable);
+    } else {
+        std::fill(source.begin(), source.end(), 0);
+    }
+
+    // the first level are the vertices connected to the sink or with excess
+    for (int b = 0; b < bandCount; b++) {
+        const int first = (1 + b * bandRows) * stride;
+        const int last = (1 + std::min(height, (b + 1) * bandRows)) * stride;
+        for (int v = first; v < last; v++) {
+            if (toSink ? excess[v] < 0 : excess[v] > 0) {
+                if (toSink) {
+                    labels[v] = 1;
+                } else {
+                    source[v] = 1;
+                }
+                frontiers[b].push_back(v);
+            }
+        }
+    }
+
+    for (int level = 1;; level++) {
+        cv::parallel_for_(cv::Range(0, bandCount),
+                      Search(*this, toSink, level, frontiers, outboxes[level & 1], outboxes[(level & 1) ^ 1],
+                             counts));
+
+        int found = 0;
+        for (int b = 0; b < bandCount; b++) {
+            found += counts[b];
+        }
+        if (!found) {
+            break;
+        }
+    }
+
+    if (!toSink) {
+        return 0;
+    }
+
+    int active = 0;
+    for (int v = stride; v < stride * (height + 1); v++) {
+        active += excess[v] > 0 && labels[v] != gcUnreachable;
+    }
+    return active;
+}
+
+template <class TWeight, int neighbors>
+double GCPushRelabelGraph<TWeight, neighbors>::maxFlow(bool reuseTrees)
+{
+    // without reuse the preflow is the one set up by addTermWeights(), in
+    // both cases the labels have to be computed from scratch
+    (void)reuseTrees;
+
+    int active = search(true);
+    for (int sweep = 1; active > 0; sweep++) {
+        cv::parallel_for_(cv::Range(1, height + 1), Push(*this));
+        cv::parallel_for_(cv::Range(1, height + 1), Gather(*this));
+        cv::parallel_for_(cv::Range(1, height + 1), Relabel(*this));
+        labels.swap(newLabels);
+
+        if (sweep % gcRelabelInterval == 0) {
+            active = search(true);
+        } else {
+            active = 0;
+            for (int row = 1; row <= height; row++) {
+                active += rowCounts[row];
+            }
+        }
+    }
+
+    search(false);
+
+    // the excess left in the graph flows back to the source
+    flow = 0;
+    for (int i = 0; i < width * height; i++) {
+        flow += sourceWeights[i] - std::max(excess[vtxIdx(i)], (TWeight)0);
+    }
+    return flow;
+}
+
+template <class TWeight, int neighbors>
+bool GCPushRelabelGraph<TWeight, neighbors>::inSourceSegment(int i)
+{
+    CV_Assert(i >= 0 && i < width * height);
+    return source[vtxIdx(i)] != 0;
+}
+
+template <class TWeight, int neighbors>
+void GCPushRelabelGraph<TWeight, neighbors>::saveCapacities()
+{
+    capacities = caps;
+}
+
+template <class TWeight, int neighbors>
+void GCPushRelabelGraph<TWeight, neighbors>::reset()
+{
+    CV_Assert(capacities.size() == caps.size());
+
+    caps = capacities;
+    std::fill(excess.begin(), excess.end(), 0);
+    std::fill(sourceWeights.begin(), sourceWeights.end(), 0);
+    std::fill(sinkWeights.begin(), sinkWeights.end(), 0);
+    flow = 0;
+}
+
+#endif // CV2_GCPUSHRELABEL_HPP
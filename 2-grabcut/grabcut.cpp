@@ -41,7 +41,12 @@
 
 #include "precomp.hpp"
 #include "gcgraph.hpp"
+#include "gcgridgraph.hpp"
+#include "gcibfsgraph.hpp"
+#include "gcpushrelabel.hpp"
 #include "grabcut.hpp"
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
 #include <limits>
 
@@ -73,10 +78,42 @@ class GMM
 
     int whichComponent(const Vec3d color) const;
 
+    /**
+     * Evaluates all components for a run of pixels in log space. Either
+     * output may be null.
+     *
+     * @param dataTerms     -log of the mixture probability of each pixel
+     * @param components    most likely component of each pixel, like
+     *                      whichComponent()
+     */
+    void evaluate(const Vec3b *colors, int count, double *dataTerms, int *components) const;
+
+    /**
+     * Sums of the samples of each component. Several accumulators can be
+     * filled in parallel and merged, the sums are exact for 8-bit colors.
+     */
+    struct Accumulator
+    {
+        Accumulator();
+
+        void add(int ci, const Vec3d color);
+
+        Accumulator &operator+=(const Accumulator &other);
+
+        double sums[componentsCount][3];
+        double prods[componentsCount][3][3];
+        int sampleCounts[componentsCount];
+        int totalSampleCount;
+    };
+
+    Accumulator accumulator() const { return Accumulator(); }
+
     void initLearning();
 
     void addSample(int ci, const Vec3d color);
 
+    void addSamples(const Accumulator &samples);
+
     void endLearning();
 
   private:
@@ -90,10 +127,18 @@ class GMM
     double inverseCovs[componentsCount][3][3];
     double covDeterms[componentsCount];
 
-    double sums[componentsCount][3];
-    double prods[componentsCount][3][3];
-    int sampleCounts[componentsCount];
-    int totalSampleCount;
+    // Inverse of the Cholesky factor L of each covariance matrix (L * L^T = cov),
+    // stored as lower triangle (00, 10, 11, 20, 21, 22), so that the
+    // Mahalanobis distance is ||inverse(L) * (color - mean)||^2
+    double invCholesky[componentsCount][6];
+
+    // -0.5 * log(det(cov)) and log(coef) - 0.5 * log(det(cov))
+    double logNorms[componentsCount];
+    double logWeights[componentsCount];
+
+    void logDensities(int ci, const Vec3b *colors, int count, double *result) const;
+
+    Accumulator learning;
 };
 
 GMM::GMM(Mat &_model)
@@ -194,7 +239,7 @@ int GMM::whichComponent(const Vec3d color) const
     return k;
 }
 
-void GMM::initLearning()
+GMM::Accumulator::Accumulator()
 {
     // reset all calculated sums and products to 0
     for (int ci = 0; ci < componentsCount; ci++) {
@@ -207,7 +252,7 @@ void GMM::initLearning()
     totalSampleCount = 0;
 }
 
-void GMM::addSample(int ci, const Vec3d color)
+void GMM::Accumulator::add(int ci, const Vec3d color)
 {
     sums[ci][0] += color[0];
     sums[ci][1] += color[1];
@@ -225,9 +270,46 @@ void GMM::addSample(int ci, const Vec3d color)
     totalSampleCount++;
 }
 
+GMM::Accumulator &GMM::Accumulator::operator+=(const Accumulator &other)
+{
+    for (int ci = 0; ci < componentsCount; ci++) {
+        for (int i = 0; i < 3; i++) {
+            sums[ci][i] += other.sums[ci][i];
+
+            for (int j = 0; j < 3; j++) {
+                prods[ci][i][j] += other.prods[ci][i][j];
+            }
+        }
+        sampleCounts[ci] += other.sampleCounts[ci];
+    }
+    totalSampleCount += other.totalSampleCount;
+
+    return *this;
+}
+
+void GMM::initLearning()
+{
+    learning = Accumulator();
+}
+
+void GMM::addSample(int ci, const Vec3d color)
+{
+    learning.add(ci, color);
+}
+
+void GMM::addSamples(const Accumulator &samples)
+{
+    learning += samples;
+}
+
 void GMM::endLearning()
 {
     const double variance = 0.01;
+    const double (&sums)[componentsCount][3] = learning.sums;
+    const double (&prods)[componentsCount][3][3] = learning.prods;
+    const int *sampleCounts = learning.sampleCounts;
+    const int totalSampleCount = learning.totalSampleCount;
+
     for (int ci = 0; ci < componentsCount; ci++) {
         int n = sampleCounts[ci];
         if (n == 0) {
@@ -283,6 +365,289 @@ void GMM::calcInverseCovAndDeterm(int ci)
         inverseCovs[ci][0][2] =  (c[1] * c[5] - c[2] * c[4]) / dtrm;
         inverseCovs[ci][1][2] = -(c[0] * c[5] - c[2] * c[3]) / dtrm;
         inverseCovs[ci][2][2] =  (c[0] * c[4] - c[1] * c[3]) / dtrm;
+
+        // L * D * L^T decomposition of the covariance matrix with a unit lower
+        // triangular L. A covariance matrix that passes the determinant check
+        // can still be nearly singular, so that rounding makes a pivot zero or
+        // negative. The pivots are clamped to a small fraction of the largest
+        // variance, which regularizes the matrix like the white noise in
+        // endLearning().
+        const double minPivot = std::numeric_limits<double>::epsilon() *
+                                std::max(1.0, std::max(c[0], std::max(c[4], c[8])));
+        const double p0 = std::max(c[0], minPivot);
+        const double l10 = c[3] / p0;
+        const double l20 = c[6] / p0;
+        const double p1 = std::max(c[4] - l10 * c[3], minPivot);
+        const double l21 = (c[7] - l20 * c[3]) / p1;
+        const double p2 = std::max(c[8] - l20 * c[6] - l21 * l21 * p1, minPivot);
+
+        // inverse of the Cholesky factor L * sqrt(D)
+        const double s0 = std::sqrt(p0), s1 = std::sqrt(p1), s2 = std::sqrt(p2);
+        double *m = invCholesky[ci];
+        m[0] = 1 / s0;
+        m[1] = -l10 / s1;
+        m[2] = 1 / s1;
+        m[3] = (l10 * l21 - l20) / s2;
+        m[4] = -l21 / s2;
+        m[5] = 1 / s2;
+
+        logNorms[ci] = -(std::log(s0) + std::log(s1) + std::log(s2));
+        logWeights[ci] = std::log(coefs[ci]) + logNorms[ci];
+    }
+}
+
+/**
+ * Calculates -0.5 * Mahalanobis distance of the colors to the component
+ */
+void GMM::logDensities(int ci, const Vec3b *colors, int count, double *result) const
+{
+    const double *m = invCholesky[ci];
+    const double *mu = mean + 3 * ci;
+    int i = 0;
+
+#if CV_SSE2
+    // two pixels at a time
+    const __m128d m00 = _mm_set1_pd(m[0]), m10 = _mm_set1_pd(m[1]), m11 = _mm_set1_pd(m[2]);
+    const __m128d m20 = _mm_set1_pd(m[3]), m21 = _mm_set1_pd(m[4]), m22 = _mm_set1_pd(m[5]);
+    const __m128d mu0 = _mm_set1_pd(mu[0]), mu1 = _mm_set1_pd(mu[1]), mu2 = _mm_set1_pd(mu[2]);
+    const __m128d half = _mm_set1_pd(-0.5);
+
+    for (; i + 1 < count; i += 2) {
+        const __m128d d0 = _mm_sub_pd(_mm_setr_pd(colors[i][0], colors[i + 1][0]), mu0);
+        const __m128d d1 = _mm_sub_pd(_mm_setr_pd(colors[i][1], colors[i + 1][1]), mu1);
+        const __m128d d2 = _mm_sub_pd(_mm_setr_pd(colors[i][2], colors[i + 1][2]), mu2);
+
+        const __m128d z0 = _mm_mul_pd(m00, d0);
+        const __m128d z1 = _mm_add_pd(_mm_mul_pd(m10, d0), _mm_mul_pd(m11, d1));
+        const __m128d z2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(m20, d0), _mm_mul_pd(m21, d1)), _mm_mul_pd(m22, d2));
+
+        const __m128d q = _mm_add_pd(_mm_add_pd(_mm_mul_pd(z0, z0), _mm_mul_pd(z1, z1)), _mm_mul_pd(z2, z2));
+        _mm_storeu_pd(result + i, _mm_mul_pd(half, q));
+    }
+#endif
+
+    for (; i < count; i++) {
+        const double d0 = colors[i][0] - mu[0];
+        const double d1 = colors[i][1] - mu[1];
+        const double d2 = colors[i][2] - mu[2];
+
+        const double z0 = m[0] * d0;
+        const double z1 = m[1] * d0 + m[2] * d1;
+        const double z2 = m[3] * d0 + m[4] * d1 + m[5] * d2;
+
+        result[i] = -0.5 * (z0 * z0 + z1 * z1 + z2 * z2);
+    }
+}
+
+void GMM::evaluate(const Vec3b *colors, int count, double *dataTerms, int *components) const
+{
+    const int blockSize = 64;
+    double densities[componentsCount][blockSize];
+
+    for (int start = 0; start < count; start += blockSize) {
+        const int n = std::min(blockSize, count - start);
+
+        for (int ci = 0; ci < componentsCount; ci++) {
+            if (coefs[ci] > 0) {
+                logDensities(ci, colors + start, n, densities[ci]);
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            double best = -std::numeric_limits<double>::infinity();
+            double maxTerm = -std::numeric_limits<double>::infinity();
+            int k = 0;
+
+            for (int ci = 0; ci < componentsCount; ci++) {
+                if (coefs[ci] > 0) {
+                    // like whichComponent(), the coefficient is ignored
+                    if (densities[ci][i] + logNorms[ci] > best) {
+                        best = densities[ci][i] + logNorms[ci];
+                        k = ci;
+                    }
+                    maxTerm = std::max(maxTerm, densities[ci][i] + logWeights[ci]);
+                }
+            }
+
+            if (components) {
+                components[start + i] = k;
+            }
+            if (dataTerms) {
+                if (maxTerm == -std::numeric_limits<double>::infinity()) {
+                    dataTerms[start + i] = std::numeric_limits<double>::infinity();
+                    continue;
+                }
+
+                // log-sum-exp relative to the largest term
+                double sum = 0;
+                for (int ci = 0; ci < componentsCount; ci++) {
+                    if (coefs[ci] > 0) {
+                        sum += exp(densities[ci][i] + logWeights[ci] - maxTerm);
+                    }
+                }
+                dataTerms[start + i] = -(maxTerm + std::log(sum));
+            }
+        }
+    }
+}
+
+/**
+ * Color histogram with bins^3 cells of equal size
+ *
+ * It has the interface of GMM, but each bin takes the role of a component:
+ * evaluate() returns the bin of each color, the accumulators count the
+ * samples per bin, and endLearning() stores the data term of each bin in the
+ * model. The likelihood is the relative frequency of the bin, smoothed by
+ * adding a number of samples to each bin, divided by the volume of the bin,
+ * so that the data terms are densities like those of the GMM.
+ */
+class ColorHistogram
+{
+  public:
+    // each accumulator counts the samples of all bins
+    static const int maxBins = 32;
+
+    ColorHistogram(Mat &_model, int _bins, double _smoothing);
+
+    double operator()(const Vec3d color) const;
+
+    int whichBin(const Vec3b color) const;
+
+    /**
+     * Looks up the data terms and the bins of a run of pixels. Either output
+     * may be null.
+     */
+    void evaluate(const Vec3b *colors, int count, double *dataTerms, int *components) const;
+
+    struct Accumulator
+    {
+        Accumulator() : totalSampleCount(0) {}
+
+        void add(int bin, const Vec3d color);
+
+        Accumulator &operator+=(const Accumulator &other);
+
+        std::vector<int> sampleCounts;
+        int totalSampleCount;
+    };
+
+    Accumulator accumulator() const;
+
+    void initLearning();
+
+    void addSample(int bin, const Vec3d color);
+
+    void addSamples(const Accumulator &samples);
+
+    void endLearning();
+
+  private:
+    Mat model;
+    double *terms;  // -log of the density of each bin
+    int bins;
+    double smoothing;
+    int binOf[256]; // bin of each channel value
+
+    Accumulator learning;
+};
+
+ColorHistogram::ColorHistogram(Mat &_model, int _bins, double _smoothing) :
+    bins(_bins), smoothing(_smoothing)
+{
+    const int cells = bins * bins * bins;
+
+    // The model holds the data term of each bin. A new histogram is uniform.
+    if (_model.empty()) {
+        _model.create(1, cells, CV_64FC1);
+        _model.setTo(Scalar(3 * std::log(256.0)));
+    } else if ((_model.type() != CV_64FC1) || (_model.rows != 1) || (_model.cols != cells)) {
+        CV_Error(CV_StsBadArg, "_model must have CV_64FC1 type, rows == 1 and cols == bins^3");
+    }
+
+    model = _model;
+    terms = model.ptr<double>(0);
+
+    for (int v = 0; v < 256; v++) {
+        binOf[v] = v * bins / 256;
+    }
+}
+
+/**
+ * Returns the probability density for a given color
+ */
+double ColorHistogram::operator()(const Vec3d color) const
+{
+    return exp(-terms[whichBin(Vec3b(saturate_cast<uchar>(color[0]), saturate_cast<uchar>(color[1]),
+                                     saturate_cast<uchar>(color[2])))]);
+}
+
+int ColorHistogram::whichBin(const Vec3b color) const
+{
+    return (binOf[color[0]] * bins + binOf[color[1]]) * bins + binOf[color[2]];
+}
+
+void ColorHistogram::evaluate(const Vec3b *colors, int count, double *dataTerms, int *components) const
+{
+    for (int i = 0; i < count; i++) {
+        const int bin = whichBin(colors[i]);
+
+        if (components) {
+            components[i] = bin;
+        }
+        if (dataTerms) {
+            dataTerms[i] = terms[bin];
+        }
+    }
+}
+
+void ColorHistogram::Accumulator::add(int bin, const Vec3d)
+{
+    sampleCounts[bin]++;
+    totalSampleCount++;
+}
+
+ColorHistogram::Accumulator &ColorHistogram::Accumulator::operator+=(const Accumulator &other)
+{
+    for (size_t bin = 0; bin < sampleCounts.size(); bin++) {
+        sampleCounts[bin] += other.sampleCounts[bin];
+    }
+    totalSampleCount += other.totalSampleCount;
+
+    return *this;
+}
+
+/**
+ * Returns an empty accumulator with a counter for each bin
+ */
+ColorHistogram::Accumulator ColorHistogram::accumulator() const
+{
+    Accumulator samples;
+    samples.sampleCounts.assign(model.cols, 0);
+    return samples;
+}
+
+void ColorHistogram::initLearning()
+{
+    learning = accumulator();
+}
+
+void ColorHistogram::addSample(int bin, const Vec3d color)
+{
+    learning.add(bin, color);
+}
+
+void ColorHistogram::addSamples(const Accumulator &samples)
+{
+    learning += samples;
+}
+
+void ColorHistogram::endLearning()
+{
+    const double binVolume = std::pow(256.0 / bins, 3);
+    const double total = learning.totalSampleCount + smoothing * model.cols;
+
+    for (int bin = 0; bin < model.cols; bin++) {
+        terms[bin] = -std::log((learning.sampleCounts[bin] + smoothing) / (total * binVolume));
     }
 }
 
@@ -306,195 +671,287 @@ static inline double countEdges(const Mat &img, int neighbors)
     }
 }
 
+// rows per stripe of the parallel neighbor passes. The stripes are fixed, so
+// the reduction of the partial sums does not depend on the number of threads.
+static const int stripeRows = 32;
+
+// weight of the standard pairwise term relative to the data term
+static const double pairwiseGamma = 50;
+
+// largest squared distance of two 8-bit colors
+static const int maxSqrColorDist = 3 * 255 * 255;
+
+static inline int sqrColorDist(const Vec3b &a, const Vec3b &b)
+{
+    const int d0 = a[0] - b[0];
+    const int d1 = a[1] - b[1];
+    const int d2 = a[2] - b[2];
+
+    return d0 * d0 + d1 * d1 + d2 * d2;
+}
+
 /**
- * Calculate beta - parameter of GrabCut algorithm.
- *
- * beta = 1 / (2 * avg(sqr(||color[i] - color[j]||)))
+ * Converts the weights, which are calculated in double precision, to the
+ * capacity type of the graph
  */
-static double calcBeta(const Mat &img, int neighbors)
+template <class TWeight> struct Capacity
 {
-    double beta = 0;
-    for (int y = 0; y < img.rows; y++) {
-        for (int x = 0; x < img.cols; x++) {
-            Vec3d color = img.at<Vec3b>(y, x);
-            // left
-            if (x > 0) {
-                Vec3d diff = color - (Vec3d) img.at<Vec3b>(y, x - 1);
-                beta += diff.dot(diff);
-            }
-            // upleft
-            if (neighbors == GC_N8 && y > 0 && x > 0) {
-                Vec3d diff = color - (Vec3d) img.at<Vec3b>(y - 1, x - 1);
-                beta += diff.dot(diff);
-            }
-            // up
-            if (y > 0) {
-                Vec3d diff = color - (Vec3d) img.at<Vec3b>(y - 1, x);
-                beta += diff.dot(diff);
-            }
-            // upright
-            if (neighbors == GC_N8 && y > 0 && x < img.cols - 1) {
-                Vec3d diff = color - (Vec3d) img.at<Vec3b>(y - 1, x + 1);
-                beta += diff.dot(diff);
+    static inline TWeight fromDouble(double w) { return (TWeight) w; }
+};
+
+// Integer capacities are fixed-point numbers with 10 fraction bits. They are
+// limited to 2^26, so the capacities around a vertex add up without overflow.
+static const double fixedPointScale = 1 << 10;
+static const int maxFixedPoint = 1 << 26;
+
+template <> struct Capacity<int>
+{
+    static inline int fromDouble(double w)
+    {
+        w *= fixedPointScale;
+        if (w >= maxFixedPoint) {
+            return maxFixedPoint;
+        }
+        if (w <= -maxFixedPoint) {
+            return -maxFixedPoint;
+        }
+        return cvRound(w);
+    }
+};
+
+/**
+ * First pass of the n-weight calculation. Stores the squared color distance
+ * of each pixel to its left, upleft, up and upright neighbor in the weight
+ * matrices and sums them up per stripe. If extended is true, the distances
+ * itself are summed instead of the squared ones. Empty matrices are skipped,
+ * so the pass can compute the sums alone.
+ */
+template <class TWeight>
+class NeighborDistances : public ParallelLoopBody
+{
+  public:
+    NeighborDistances(const Mat &_img, Mat &_leftW, Mat &_upleftW, Mat &_upW, Mat &_uprightW,
+                      int _neighbors, bool _extended, std::vector<double> &_sums) :
+        img(_img), leftW(_leftW), upleftW(_upleftW), upW(_upW), uprightW(_uprightW),
+        neighbors(_neighbors), extended(_extended), sums(_sums)
+    {}
+
+    void operator()(const Range &stripes) const
+    {
+        for (int stripe = stripes.start; stripe < stripes.end; stripe++) {
+            const int last = std::min(img.rows, (stripe + 1) * stripeRows);
+            double sum = 0;
+
+            for (int y = stripe * stripeRows; y < last; y++) {
+                const Vec3b *color = img.ptr<Vec3b>(y);
+                const Vec3b *up = y > 0 ? img.ptr<Vec3b>(y - 1) : 0;
+                TWeight *left = leftW.empty() ? 0 : leftW.ptr<TWeight>(y);
+                TWeight *upper = upW.empty() ? 0 : upW.ptr<TWeight>(y);
+                TWeight *upleft = neighbors == GC_N8 && !upleftW.empty() ? upleftW.ptr<TWeight>(y) : 0;
+                TWeight *upright = neighbors == GC_N8 && !uprightW.empty() ? uprightW.ptr<TWeight>(y) : 0;
+
+                // the squared distances are exact in all capacity types
+                for (int x = 0; x < img.cols; x++) {
+                    const int l = x > 0 ? sqrColorDist(color[x], color[x - 1]) : 0;
+                    const int u = up ? sqrColorDist(color[x], up[x]) : 0;
+                    sum += extended ? std::sqrt((double) l) + std::sqrt((double) u) : l + u;
+                    if (left) {
+                        left[x] = l;
+                        upper[x] = u;
+                    }
+
+                    if (neighbors == GC_N8) {
+                        const int ul = up && x > 0 ? sqrColorDist(color[x], up[x - 1]) : 0;
+                        const int ur = up && x < img.cols - 1 ? sqrColorDist(color[x], up[x + 1]) : 0;
+                        sum += extended ? std::sqrt((double) ul) + std::sqrt((double) ur) : ul + ur;
+                        if (upleft) {
+                            upleft[x] = ul;
+                            upright[x] = ur;
+                        }
+                    }
+                }
             }
+            sums[stripe] = sum;
         }
     }
-    if (beta <= std::numeric_limits<double>::epsilon()) {
-        return 0;
-    } else {
-        return 1.f / (2 * beta / countEdges(img, neighbors));
+
+  private:
+    const Mat &img;
+    Mat &leftW, &upleftW, &upW, &uprightW;
+    const int neighbors;
+    const bool extended;
+    std::vector<double> &sums;
+};
+
+/**
+ * Pairwise term of two neighbors with the given squared color distance
+ *
+ * Standard pairwise term: scale * exp(-beta * ||diff||^2)
+ * Extended pairwise term: connectivity + contrast * exp(-beta * ||diff||)
+ *
+ * The scale is gamma for horizontal and vertical neighbors and
+ * gamma / sqrt(2) for diagonal ones. The extended term ignores it.
+ */
+static inline double pairwiseWeight(double sqrDist, double scale, bool extended, double beta,
+                                    double connectivity, double contrast)
+{
+    if (extended) {
+        return connectivity + contrast * exp(-beta * std::sqrt(sqrDist));
     }
+    return scale * exp(-beta * sqrDist);
 }
 
 /**
- * Calculate beta for the extended pairwise / binary / smoothing term 
- * as parameter of GrabCut algorithm.
+ * Second pass of the n-weight calculation. Replaces the squared color
+ * distances in the weight matrices by the weights. Missing neighbors at the
+ * image border keep the weight 0.
  *
- * beta = 2 / (avg(||color[i] - color[j]||))
+ * If a lookup table is given, it holds exp(-beta * d) for the standard and the
+ * complete weight for the extended pairwise term for each squared distance d.
  */
-static double calcExtendedBeta(const Mat &img, int neighbors)
+template <class TWeight>
+class NeighborWeights : public ParallelLoopBody
 {
-    double beta = 0;
-
-    for (int y = 0; y < img.rows; y++) {
-        for (int x = 0; x < img.cols; x++) {
-            Vec3d color = img.at<Vec3b>(y, x);
-            // left
-            if (x > 0) {
-                beta += norm(color - (Vec3d) img.at<Vec3b>(y, x - 1));
-            }
-            // upleft
-            if (neighbors == GC_N8 && y > 0 && x > 0) {
-                beta += norm(color - (Vec3d) img.at<Vec3b>(y - 1, x - 1));
-            }
-            // up
-            if (y > 0) {
-                beta += norm(color - (Vec3d) img.at<Vec3b>(y - 1, x));
-            }
-            // upright
-            if (neighbors == GC_N8 && y > 0 && x < img.cols - 1) {
-                beta += norm(color - (Vec3d) img.at<Vec3b>(y - 1, x + 1));
+  public:
+    NeighborWeights(Mat &_leftW, Mat &_upleftW, Mat &_upW, Mat &_uprightW, int _neighbors, bool _extended,
+                    double _beta, double _gamma, double _connectivity, double _contrast, const double *_table) :
+        leftW(_leftW), upleftW(_upleftW), upW(_upW), uprightW(_uprightW), neighbors(_neighbors),
+        extended(_extended), beta(_beta), gamma(_gamma), connectivity(_connectivity), contrast(_contrast),
+        table(_table)
+    {}
+
+    void operator()(const Range &rows) const
+    {
+        const double gammaDivSqrt2 = gamma / std::sqrt(2.0f);
+
+        for (int y = rows.start; y < rows.end; y++) {
+            TWeight *left = leftW.ptr<TWeight>(y);
+            TWeight *upper = upW.ptr<TWeight>(y);
+            TWeight *upleft = neighbors == GC_N8 ? upleftW.ptr<TWeight>(y) : 0;
+            TWeight *upright = neighbors == GC_N8 ? uprightW.ptr<TWeight>(y) : 0;
+            const int cols = leftW.cols;
+
+            for (int x = 0; x < cols; x++) {
+                left[x] = x > 0 ? Capacity<TWeight>::fromDouble(weight(left[x], gamma)) : 0;
+                upper[x] = y > 0 ? Capacity<TWeight>::fromDouble(weight(upper[x], gamma)) : 0;
+
+                if (neighbors == GC_N8) {
+                    upleft[x] = y > 0 && x > 0 ? Capacity<TWeight>::fromDouble(weight(upleft[x], gammaDivSqrt2)) : 0;
+                    upright[x] = y > 0 && x < cols - 1 ?
+                                 Capacity<TWeight>::fromDouble(weight(upright[x], gammaDivSqrt2)) : 0;
+                }
             }
         }
     }
-    if (beta <= std::numeric_limits<double>::epsilon()) {
-        return 0;
+
+  private:
+    inline double weight(double sqrDist, double scale) const
+    {
+        if (table) {
+            const double value = table[(int) sqrDist];
+            return extended ? value : scale * value;
+        }
+        return pairwiseWeight(sqrDist, scale, extended, beta, connectivity, contrast);
     }
 
-    return 2.f / (beta / countEdges(img, neighbors));
-}
+    Mat &leftW, &upleftW, &upW, &uprightW;
+    const int neighbors;
+    const bool extended;
+    const double beta, gamma, connectivity, contrast;
+    const double *table;
+};
 
-static void calcExtendedNWeights(const Mat &img, Mat &leftW, Mat &upleftW, Mat &upW, Mat &uprightW,
-                                 double beta, double connectivity, double contrast, int neighbors)
+/**
+ * Calculates beta of the pairwise term from the color distances of all
+ * neighbors. The squared distances are stored in the weight matrices unless
+ * they are empty.
+ */
+template <class TWeight>
+static double calcBeta(const Mat &img, Mat &leftW, Mat &upleftW, Mat &upW, Mat &uprightW,
+                       bool extended, int neighbors)
 {
-    // with this hack, because the exponential part will always be in the interval (0, 1]
-    // setting contrast = connectivity, the pairwise term only positive values.
-    // if (contrast > connectivity) {
-    //     std::cerr << "[warn] contrast > connectivity, set contrast = connectivity" << std::endl;
-    //     contrast = connectivity;
-    // }
+    const int stripes = (img.rows + stripeRows - 1) / stripeRows;
+    std::vector<double> sums(stripes, 0);
 
-    // initialize all matrices
-    leftW.create(img.rows, img.cols, CV_64FC1);
-    upW.create(img.rows, img.cols, CV_64FC1);
+    parallel_for_(Range(0, stripes),
+                  NeighborDistances<TWeight>(img, leftW, upleftW, upW, uprightW, neighbors, extended, sums));
 
-    if (neighbors == GC_N8) {
-        upleftW.create(img.rows, img.cols, CV_64FC1);
-        uprightW.create(img.rows, img.cols, CV_64FC1);
+    // reduce the partial sums in a fixed order
+    double sum = 0;
+    for (int stripe = 0; stripe < stripes; stripe++) {
+        sum += sums[stripe];
     }
 
-    for (int y = 0; y < img.rows; y++) {
-        for (int x = 0; x < img.cols; x++) {
-            Vec3d color = img.at<Vec3b>(y, x);
-            // left
-            if (x - 1 >= 0) {
-                const Vec3d diff = color - (Vec3d) img.at<Vec3b>(y, x - 1);
-                leftW.at<double>(y, x) = connectivity + contrast * exp(-beta * norm(diff));
-            } else {
-                leftW.at<double>(y, x) = 0;
-            }
-            // up
-            if (y - 1 >= 0) {
-                const Vec3d diff = color - (Vec3d) img.at<Vec3b>(y - 1, x);
-                upW.at<double>(y, x) = connectivity + contrast * exp(-beta * norm(diff));
-            } else {
-                upW.at<double>(y, x) = 0;
-            }
-            if (neighbors == GC_N8) {
-                // upleft
-                if (x - 1 >= 0 && y - 1 >= 0) {
-                    const Vec3d diff = color - (Vec3d) img.at<Vec3b>(y - 1, x - 1);
-                    upleftW.at<double>(y, x) = connectivity + contrast * exp(-beta * norm(diff));
-                } else {
-                    upleftW.at<double>(y, x) = 0;
-                }
-                // upright
-                if (x + 1 < img.cols && y - 1 >= 0) {
-                    const Vec3d diff = color - (Vec3d) img.at<Vec3b>(y - 1, x + 1);
-                    uprightW.at<double>(y, x) = connectivity + contrast * exp(-beta * norm(diff));
-                } else {
-                    uprightW.at<double>(y, x) = 0;
-                }
-            }
-        }
+    double beta = 0;
+    if (sum > std::numeric_limits<double>::epsilon()) {
+        beta = extended ? 2.f / (sum / countEdges(img, neighbors))
+                        : 1.f / (2 * sum / countEdges(img, neighbors));
     }
+    return beta;
 }
 
 /**
  * Calculate weights of noterminal vertices of graph.
  * N means the neighbors of the graph.
- * 
- * beta and gamma - parameters of GrabCut algorithm.
+ *
+ * The color distances of all neighbors are calculated once in a row-parallel
+ * pass, which also sums them up for beta. A second row-parallel pass turns
+ * the distances into weights.
+ *
+ * Standard pairwise term:
+ *     beta = 1 / (2 * avg(sqr(||color[i] - color[j]||)))
+ *     weight = gamma * exp(-beta * sqr(||color[i] - color[j]||)),
+ *     diagonal neighbors are weighted with gamma / sqrt(2)
+ *
+ * Extended pairwise / binary / smoothing term:
+ *     beta = 2 / (avg(||color[i] - color[j]||))
+ *     weight = connectivity + contrast * exp(-beta * ||color[i] - color[j]||)
+ *
+ * The weights are calculated in double precision and stored with the capacity
+ * type TWeight of the graph.
  */
+template <class TWeight>
 static void calcNWeights(const Mat &img, Mat &leftW, Mat &upleftW, Mat &upW, Mat &uprightW,
-                         double beta, double gamma, int neighbors)
+                         double gamma, bool extended, double connectivity, double contrast, int neighbors)
 {
-    const double gammaDivSqrt2 = gamma / std::sqrt(2.0f);
+    // with this hack, because the exponential part will always be in the interval (0, 1]
+    // setting contrast = connectivity, the pairwise term only positive values.
+    // if (contrast > connectivity) {
+    //     std::cerr << "[warn] contrast > connectivity, set contrast = connectivity" << std::endl;
+    //     contrast = connectivity;
+    // }
 
     // initialize all matrices
-    leftW.create(img.rows, img.cols, CV_64FC1);
-    upW.create(img.rows, img.cols, CV_64FC1);
+    leftW.create(img.rows, img.cols, DataType<TWeight>::type);
+    upW.create(img.rows, img.cols, DataType<TWeight>::type);
 
     if (neighbors == GC_N8) {
-        upleftW.create(img.rows, img.cols, CV_64FC1);
-        uprightW.create(img.rows, img.cols, CV_64FC1);
+        upleftW.create(img.rows, img.cols, DataType<TWeight>::type);
+        uprightW.create(img.rows, img.cols, DataType<TWeight>::type);
     }
 
-    for (int y = 0; y < img.rows; y++) {
-        for (int x = 0; x < img.cols; x++) {
-            Vec3d color = img.at<Vec3b>(y, x);
-            // left
-            if (x - 1 >= 0) {
-                Vec3d diff = color - (Vec3d) img.at<Vec3b>(y, x - 1);
-                leftW.at<double>(y, x) = gamma * exp(-beta * diff.dot(diff));
-            } else {
-                leftW.at<double>(y, x) = 0;
-            }
-            // up
-            if (y - 1 >= 0) {
-                Vec3d diff = color - (Vec3d) img.at<Vec3b>(y - 1, x);
-                upW.at<double>(y, x) = gamma * exp(-beta * diff.dot(diff));
+    const double beta = calcBeta<TWeight>(img, leftW, upleftW, upW, uprightW, extended, neighbors);
+
+    // The squared distances are integers in [0, 3 * 255^2]. If there are more
+    // edges than table entries, the exponential is evaluated once per
+    // distance instead of once per edge.
+    std::vector<double> table;
+
+    if (countEdges(img, neighbors) > maxSqrColorDist + 1) {
+        table.resize(maxSqrColorDist + 1);
+
+        for (int d = 0; d <= maxSqrColorDist; d++) {
+            if (extended) {
+                table[d] = connectivity + contrast * exp(-beta * std::sqrt((double) d));
             } else {
-                upW.at<double>(y, x) = 0;
-            }
-            if (neighbors == GC_N8) {
-                // upleft
-                if (x - 1 >= 0 && y - 1 >= 0) {
-                    Vec3d diff = color - (Vec3d) img.at<Vec3b>(y - 1, x - 1);
-                    upleftW.at<double>(y, x) = gammaDivSqrt2 * exp(-beta * diff.dot(diff));
-                } else {
-                    upleftW.at<double>(y, x) = 0;
-                }
-                // upright
-                if (x + 1 < img.cols && y - 1 >= 0) {
-                    Vec3d diff = color - (Vec3d) img.at<Vec3b>(y - 1, x + 1);
-                    uprightW.at<double>(y, x) = gammaDivSqrt2 * exp(-beta * diff.dot(diff));
-                } else {
-                    uprightW.at<double>(y, x) = 0;
-                }
+                table[d] = exp(-beta * d);
             }
         }
     }
+
+    parallel_for_(Range(0, img.rows),
+                  NeighborWeights<TWeight>(leftW, upleftW, upW, uprightW, neighbors, extended, beta, gamma,
+                                  connectivity, contrast, table.empty() ? 0 : &table[0]));
 }
 
 /**
@@ -542,37 +999,107 @@ static void initMaskWithRect(Mat &mask, Size imgSize, Rect rect)
 }
 
 /**
- * Initialize GMM background and foreground models using kmeans algorithm.
+ * Number of background pixels of the mask
  */
-static void initGMMs(const Mat &img, const Mat &mask, double tolerance,
-                     GMM &bgdGMM, GMM &fgdGMM)
+static int countBackground(const Mat &mask)
 {
-    const int kMeansItCount = 10;
-    const int kMeansType = KMEANS_PP_CENTERS;
-
-    Mat bgdLabels, fgdLabels;
-    vector<Vec3f> bgdSamples, fgdSamples;
-    vector<Point> bgdPixels, fgdPixels;
-    Point p;
-    for (p.y = 0; p.y < img.rows; p.y++) {
-        for (p.x = 0; p.x < img.cols; p.x++) {
-            if (mask.at<uchar>(p) == GC_BGD || mask.at<uchar>(p) == GC_PR_BGD) {
-                bgdSamples.push_back((Vec3f) img.at<Vec3b>(p));
-                bgdPixels.push_back(p);
-            } else { // GC_FGD | GC_PR_FGD
-                fgdSamples.push_back((Vec3f) img.at<Vec3b>(p));
-                fgdPixels.push_back(p);
+    int count = 0;
+    for (int y = 0; y < mask.rows; y++) {
+        const uchar *labels = mask.ptr<uchar>(y);
+        for (int x = 0; x < mask.cols; x++) {
+            count += labels[x] == GC_BGD || labels[x] == GC_PR_BGD;
+        }
+    }
+    return count;
+}
+
+/**
+ * Number of samples selected by the tolerance, like the portion of the
+ * samples taken in the original loop
+ */
+static int selectedSampleCount(int count, double tolerance)
+{
+    return std::max(0, std::min(count, (int) ceil(count * tolerance)));
+}
+
+/**
+ * Clusters the samples into the GMM components with the kmeans algorithm.
+ *
+ * If there are more than maxSamples samples, only maxSamples of them, one of
+ * each equally sized run of the samples, are clustered. The other samples are
+ * assigned to the most likely component of a GMM learned from the clusters.
+ * 0 clusters all samples.
+ */
+static Mat clusterSamples(const std::vector<Vec3b> &samples, int maxSamples)
+{
+    const int kMeansItCount = 10;
+    const int kMeansType = KMEANS_PP_CENTERS;
+    const int count = (int) samples.size();
+
+    // the samples are in scan order, so the strata are spread over the image
+    const bool subsample = maxSamples > 0 && count > maxSamples;
+    const int clusteredCount = subsample ? std::max(maxSamples, (int) GMM::componentsCount) : count;
+    std::vector<Vec3f> clustered(clusteredCount);
+    for (int j = 0; j < clusteredCount; j++) {
+        const int i = subsample ? (int) ((2 * (int64) j + 1) * count / (2 * (int64) clusteredCount)) : j;
+        clustered[j] = (Vec3f) samples[i];
+    }
+
+    Mat labels;
+    Mat _clustered(clusteredCount, 3, CV_32FC1, &clustered[0][0]);
+    kmeans(_clustered, GMM::componentsCount, labels,
+           TermCriteria(CV_TERMCRIT_ITER, kMeansItCount, 0.0), 0, kMeansType);
+    if (!subsample) {
+        return labels;
+    }
+
+    Mat model;
+    GMM clusters(model);
+    clusters.initLearning();
+    for (int j = 0; j < clusteredCount; j++) {
+        clusters.addSample(labels.at<int>(j, 0), clustered[j]);
+    }
+    clusters.endLearning();
+
+    labels.create(count, 1, CV_32SC1);
+    clusters.evaluate(&samples[0], count, 0, labels.ptr<int>());
+    return labels;
+}
+
+/**
+ * Initialize GMM background and foreground models using kmeans algorithm.
+ */
+static void initModels(const Mat &img, const Mat &mask, double tolerance, int initSamples,
+                       GMM &bgdGMM, GMM &fgdGMM)
+{
+    const int bgdCount = countBackground(mask);
+
+    std::vector<Vec3b> bgdSamples, fgdSamples;
+    bgdSamples.reserve(bgdCount);
+    fgdSamples.reserve(img.rows * img.cols - bgdCount);
+    #ifndef NDEBUG
+        std::vector<Point> fgdPixels;
+        fgdPixels.reserve(img.rows * img.cols - bgdCount);
+    #endif
+    for (int y = 0; y < img.rows; y++) {
+        const Vec3b *colors = img.ptr<Vec3b>(y);
+        const uchar *labels = mask.ptr<uchar>(y);
+
+        for (int x = 0; x < img.cols; x++) {
+            if (labels[x] == GC_BGD || labels[x] == GC_PR_BGD) {
+                bgdSamples.push_back(colors[x]);
+            } else { // GC_FGD | GC_PR_FGD
+                fgdSamples.push_back(colors[x]);
+                #ifndef NDEBUG
+                    fgdPixels.push_back(Point(x, y));
+                #endif
             }
         }
     }
     // cluster input data with k-means algorithm
     CV_Assert(!bgdSamples.empty() && !fgdSamples.empty());
-    Mat _bgdSamples((int) bgdSamples.size(), 3, CV_32FC1, &bgdSamples[0][0]);
-    kmeans(_bgdSamples, GMM::componentsCount, bgdLabels,
-           TermCriteria(CV_TERMCRIT_ITER, kMeansItCount, 0.0), 0, kMeansType);
-    Mat _fgdSamples((int) fgdSamples.size(), 3, CV_32FC1, &fgdSamples[0][0]);
-    kmeans(_fgdSamples, GMM::componentsCount, fgdLabels,
-           TermCriteria(CV_TERMCRIT_ITER, kMeansItCount, 0.0), 0, kMeansType);
+    Mat bgdLabels = clusterSamples(bgdSamples, initSamples);
+    Mat fgdLabels = clusterSamples(fgdSamples, initSamples);
 
     bgdGMM.initLearning();
     for (int i = 0; i < (int) bgdSamples.size(); i++) {
@@ -581,16 +1108,23 @@ static void initGMMs(const Mat &img, const Mat &mask, double tolerance,
     bgdGMM.endLearning();
 
     // determine the set of foreground samples that are most unlikly in the
-    // background dsitribution.
-    vector<double> probabilities(fgdSamples.size());
-    vector<int>    sampleIdx(fgdSamples.size());
+    // background dsitribution, i.e. have the largest data terms. Only the
+    // selected samples have to come first, their order does not matter.
+    // Samples with equal terms at the end of the selection are picked
+    // arbitrarily, so a full sort could select a different set.
+    std::vector<int> sampleIdx(fgdSamples.size());
     for (int i = 0; i < (int) fgdSamples.size(); i++) {
-        probabilities[i] = bgdGMM(fgdSamples[i]);
         sampleIdx[i] = i;
     }
-    std::sort(sampleIdx.begin(), sampleIdx.end(), [&probabilities] (int const& a, int const& b) {
-        return probabilities[a] < probabilities[b];
-    });
+    const int selectedCount = selectedSampleCount((int) sampleIdx.size(), tolerance);
+    if (selectedCount < (int) sampleIdx.size()) {
+        std::vector<double> terms(fgdSamples.size());
+        bgdGMM.evaluate(&fgdSamples[0], (int) fgdSamples.size(), &terms[0], 0);
+        std::nth_element(sampleIdx.begin(), sampleIdx.begin() + selectedCount, sampleIdx.end(),
+                         [&terms] (int const& a, int const& b) {
+            return terms[a] > terms[b];
+        });
+    }
 
     #ifndef NDEBUG
         Mat canvas;
@@ -598,7 +1132,7 @@ static void initGMMs(const Mat &img, const Mat &mask, double tolerance,
     #endif
 
     fgdGMM.initLearning();
-    for (int i = 0; i < sampleIdx.size() * tolerance; i++) {
+    for (int i = 0; i < selectedCount; i++) {
         #ifndef NDEBUG
             cv::circle(canvas, fgdPixels[sampleIdx[i]], 2, cv::Scalar(0, 0, 255), -1);
         #endif
@@ -614,43 +1148,393 @@ static void initGMMs(const Mat &img, const Mat &mask, double tolerance,
 }
 
 /**
- * Assign GMMs components for each pixel.
+ * Initialize the background and foreground histograms. Like the GMMs, the
+ * foreground histogram is learned from the portion of the foreground pixels
+ * that is most unlikely in the background histogram. The histograms are not
+ * clustered, so initSamples is ignored.
  */
-static void assignGMMsComponents(const Mat &img, const Mat &mask, const GMM &bgdGMM, const GMM &fgdGMM, Mat &compIdxs)
+static void initModels(const Mat &img, const Mat &mask, double tolerance, int /* initSamples */,
+                       ColorHistogram &bgdHist, ColorHistogram &fgdHist)
 {
-    Point p;
-    for (p.y = 0; p.y < img.rows; p.y++) {
-        for (p.x = 0; p.x < img.cols; p.x++) {
-            Vec3d color = img.at<Vec3b>(p);
-            compIdxs.at<int>(p) = mask.at<uchar>(p) == GC_BGD || mask.at<uchar>(p) == GC_PR_BGD ?
-                                  bgdGMM.whichComponent(color) : fgdGMM.whichComponent(color);
+    const int bgdSampleCount = countBackground(mask);
+
+    std::vector<Vec3b> fgdSamples;
+    fgdSamples.reserve(img.rows * img.cols - bgdSampleCount);
+
+    bgdHist.initLearning();
+    for (int y = 0; y < img.rows; y++) {
+        const Vec3b *colors = img.ptr<Vec3b>(y);
+        const uchar *labels = mask.ptr<uchar>(y);
+
+        for (int x = 0; x < img.cols; x++) {
+            if (labels[x] == GC_BGD || labels[x] == GC_PR_BGD) {
+                bgdHist.addSample(bgdHist.whichBin(colors[x]), colors[x]);
+            } else { // GC_FGD | GC_PR_FGD
+                fgdSamples.push_back(colors[x]);
+            }
         }
     }
+    CV_Assert(bgdSampleCount > 0 && !fgdSamples.empty());
+    bgdHist.endLearning();
+
+    // the most unlikely samples have the largest data terms, ties at the end
+    // of the selection are picked arbitrarily
+    std::vector<int> sampleIdx(fgdSamples.size());
+    for (int i = 0; i < (int) fgdSamples.size(); i++) {
+        sampleIdx[i] = i;
+    }
+    const int selectedCount = selectedSampleCount((int) sampleIdx.size(), tolerance);
+    if (selectedCount < (int) sampleIdx.size()) {
+        std::vector<double> terms(fgdSamples.size());
+        bgdHist.evaluate(&fgdSamples[0], (int) fgdSamples.size(), &terms[0], 0);
+        std::nth_element(sampleIdx.begin(), sampleIdx.begin() + selectedCount, sampleIdx.end(),
+                         [&terms] (int const& a, int const& b) {
+            return terms[a] > terms[b];
+        });
+    }
+
+    fgdHist.initLearning();
+    for (int i = 0; i < selectedCount; i++) {
+        const Vec3b color = fgdSamples[sampleIdx[i]];
+        fgdHist.addSample(fgdHist.whichBin(color), color);
+    }
+    fgdHist.endLearning();
 }
 
 /**
- * Learn GMMs parameters.
+ * Distinct colors of an image. Each pixel refers to its color by an index,
+ * so that per-color values have to be calculated only once.
  */
-static void learnGMMs(const Mat &img, const Mat &mask, const Mat &compIdxs, GMM &bgdGMM, GMM &fgdGMM)
+class ColorIndex
 {
-    bgdGMM.initLearning();
-    fgdGMM.initLearning();
-    Point p;
-    for (int ci = 0; ci < GMM::componentsCount; ci++) {
-        for (p.y = 0; p.y < img.rows; p.y++) {
-            for (p.x = 0; p.x < img.cols; p.x++) {
-                if (compIdxs.at<int>(p) == ci) {
-                    if (mask.at<uchar>(p) == GC_BGD || mask.at<uchar>(p) == GC_PR_BGD) {
-                        bgdGMM.addSample(ci, img.at<Vec3b>(p));
+  public:
+    explicit ColorIndex(const Mat &img);
+
+    const std::vector<Vec3b> &colors() const { return uniqueColors; }
+
+    /**
+     * CV_32SC1 matrix with the index of the color of each pixel
+     */
+    const Mat &indices() const { return pixelIndices; }
+
+  private:
+    std::vector<Vec3b> uniqueColors;
+    Mat pixelIndices;
+
+    /**
+     * Slot of a key in a table with 2^bits slots. The low bits of the
+     * multiplicative hash depend only on the low bits of the key, i.e. on
+     * the last channel, so the slot is taken from the high bits.
+     */
+    static size_t slotOf(uint32_t key, int bits) { return (uint32_t) (key * 2654435761u) >> (32 - bits); }
+};
+
+/**
+ * Builds the index with an open-addressing hash table on the packed 24-bit
+ * color. The table is kept at most half full.
+ */
+ColorIndex::ColorIndex(const Mat &img)
+{
+    int bits = 10;
+    std::vector<uint32_t> keys((size_t) 1 << bits, 0);   // packed color + 1, 0 marks an empty slot
+    std::vector<int> values(keys.size());
+    size_t mask = keys.size() - 1;
+
+    pixelIndices.create(img.size(), CV_32SC1);
+
+    for (int y = 0; y < img.rows; y++) {
+        const Vec3b *colors = img.ptr<Vec3b>(y);
+        int *indices = pixelIndices.ptr<int>(y);
+
+        for (int x = 0; x < img.cols; x++) {
+            const uint32_t key = ((uint32_t) colors[x][0] << 16 | (uint32_t) colors[x][1] << 8 | colors[x][2]) + 1;
+            size_t slot = slotOf(key, bits);
+
+            while (keys[slot] != 0 && keys[slot] != key) {
+                slot = (slot + 1) & mask;
+            }
+
+            if (keys[slot] == 0) {
+                keys[slot] = key;
+                values[slot] = (int) uniqueColors.size();
+                uniqueColors.push_back(colors[x]);
+
+                // grow and rehash
+                if (2 * uniqueColors.size() > keys.size()) {
+                    std::vector<uint32_t> oldKeys;
+                    std::vector<int> oldValues;
+                    oldKeys.swap(keys);
+                    oldValues.swap(values);
+                    bits++;
+                    keys.assign((size_t) 1 << bits, 0);
+                    values.resize(keys.size());
+                    mask = keys.size() - 1;
+
+                    for (size_t i = 0; i < oldKeys.size(); i++) {
+                        if (oldKeys[i] != 0) {
+                            size_t s = slotOf(oldKeys[i], bits);
+                            while (keys[s] != 0) {
+                                s = (s + 1) & mask;
+                            }
+                            keys[s] = oldKeys[i];
+                            values[s] = oldValues[i];
+                        }
+                    }
+                    indices[x] = (int) uniqueColors.size() - 1;
+                    continue;
+                }
+            }
+            indices[x] = values[slot];
+        }
+    }
+}
+
+// colors per task of the parallel model evaluation
+static const int evaluateBlockSize = 1024;
+
+/**
+ * Data terms and most likely components of both GMMs for each distinct color
+ */
+struct ColorLikelihoods
+{
+    std::vector<double> bgdTerms, fgdTerms;
+    std::vector<int> bgdComponents, fgdComponents;
+};
+
+template <class Model>
+class EvaluateColors : public ParallelLoopBody
+{
+  public:
+    EvaluateColors(const Model &_gmm, const std::vector<Vec3b> &_colors, double *_terms, int *_components) :
+        gmm(_gmm), colors(_colors), terms(_terms), components(_components)
+    {}
+
+    void operator()(const Range &blocks) const
+    {
+        const int count = (int) colors.size();
+
+        for (int block = blocks.start; block < blocks.end; block++) {
+            const int first = block * evaluateBlockSize;
+            const int n = std::min(evaluateBlockSize, count - first);
+
+            gmm.evaluate(&colors[first], n, terms ? terms + first : 0, components ? components + first : 0);
+        }
+    }
+
+  private:
+    const Model &gmm;
+    const std::vector<Vec3b> &colors;
+    double *terms;
+    int *components;
+};
+
+/**
+ * Evaluates the GMM or histogram once for each distinct color. Either output
+ * may be null.
+ */
+template <class Model>
+static void evaluateColors(const Model &gmm, const std::vector<Vec3b> &colors, double *terms, int *components)
+{
+    const int blocks = ((int) colors.size() + evaluateBlockSize - 1) / evaluateBlockSize;
+    parallel_for_(Range(0, blocks), EvaluateColors<Model>(gmm, colors, terms, components));
+}
+
+/**
+ * Assigns each pixel to the most likely component of its GMM and sums up the
+ * samples of each component for a stripe of rows. Each stripe has its own
+ * accumulators.
+ */
+template <class Model>
+class AssignAndLearn : public ParallelLoopBody
+{
+  public:
+    typedef typename Model::Accumulator Accumulator;
+
+    AssignAndLearn(const Mat &_img, const Mat &_mask, const ColorIndex &_index, const ColorLikelihoods &_cache,
+                   std::vector<Accumulator> &_bgdSamples, std::vector<Accumulator> &_fgdSamples) :
+        img(_img), mask(_mask), index(_index), cache(_cache), bgdSamples(_bgdSamples), fgdSamples(_fgdSamples)
+    {}
+
+    void operator()(const Range &stripes) const
+    {
+        for (int stripe = stripes.start; stripe < stripes.end; stripe++) {
+            const int last = std::min(img.rows, (stripe + 1) * stripeRows);
+            Accumulator &bgd = bgdSamples[stripe];
+            Accumulator &fgd = fgdSamples[stripe];
+
+            for (int y = stripe * stripeRows; y < last; y++) {
+                const Vec3b *colors = img.ptr<Vec3b>(y);
+                const uchar *labels = mask.ptr<uchar>(y);
+                const int *indices = index.indices().ptr<int>(y);
+
+                for (int x = 0; x < img.cols; x++) {
+                    if (labels[x] == GC_BGD || labels[x] == GC_PR_BGD) {
+                        bgd.add(cache.bgdComponents[indices[x]], colors[x]);
                     } else {
-                        fgdGMM.addSample(ci, img.at<Vec3b>(p));
+                        fgd.add(cache.fgdComponents[indices[x]], colors[x]);
                     }
                 }
             }
         }
     }
+
+  private:
+    const Mat &img;
+    const Mat &mask;
+    const ColorIndex &index;
+    const ColorLikelihoods &cache;
+    std::vector<Accumulator> &bgdSamples, &fgdSamples;
+};
+
+/**
+ * Assign GMMs components for each pixel and learn the GMMs parameters from
+ * this assignment in a single row-parallel pass. The components are chosen
+ * with the parameters of the previous iteration. Afterwards the data terms
+ * of the new parameters are stored in the cache.
+ *
+ * Histograms are learned the same way, with the bins as components.
+ */
+template <class Model>
+static void assignAndLearnGMMs(const Mat &img, const Mat &mask, const ColorIndex &index,
+                               Model &bgdGMM, Model &fgdGMM, ColorLikelihoods &cache)
+{
+    const std::vector<Vec3b> &colors = index.colors();
+
+    cache.bgdComponents.resize(colors.size());
+    cache.fgdComponents.resize(colors.size());
+    evaluateColors(bgdGMM, colors, 0, &cache.bgdComponents[0]);
+    evaluateColors(fgdGMM, colors, 0, &cache.fgdComponents[0]);
+
+    const int stripes = (img.rows + stripeRows - 1) / stripeRows;
+    std::vector<typename Model::Accumulator> bgdSamples(stripes, bgdGMM.accumulator());
+    std::vector<typename Model::Accumulator> fgdSamples(stripes, fgdGMM.accumulator());
+
+    parallel_for_(Range(0, stripes), AssignAndLearn<Model>(img, mask, index, cache, bgdSamples, fgdSamples));
+
+    bgdGMM.initLearning();
+    fgdGMM.initLearning();
+    for (int stripe = 0; stripe < stripes; stripe++) {
+        bgdGMM.addSamples(bgdSamples[stripe]);
+        fgdGMM.addSamples(fgdSamples[stripe]);
+    }
     bgdGMM.endLearning();
     fgdGMM.endLearning();
+
+    cache.bgdTerms.resize(colors.size());
+    cache.fgdTerms.resize(colors.size());
+    evaluateColors(bgdGMM, colors, &cache.bgdTerms[0], 0);
+    evaluateColors(fgdGMM, colors, &cache.fgdTerms[0], 0);
+}
+
+/**
+ * Allocates a graph with one vertex per pixel
+ */
+template <class TWeight>
+static void createGraph(GCGraph<TWeight> &graph, Size size)
+{
+    int vtxCount = size.width * size.height;
+    int edgeCount = 2 * (4 * size.width * size.height - 3 * (size.width + size.height) + 2);
+    graph.create(vtxCount, edgeCount);
+
+    for (int i = 0; i < vtxCount; i++) {
+        graph.addVtx();
+    }
+}
+
+template <class TWeight, int neighbors>
+static void createGraph(GCGridGraph<TWeight, neighbors> &graph, Size size)
+{
+    graph.create(size.width, size.height);
+}
+
+template <class TWeight, int neighbors>
+static void createGraph(GCIBFSGraph<TWeight, neighbors> &graph, Size size)
+{
+    graph.create(size.width, size.height);
+}
+
+template <class TWeight, int neighbors>
+static void createGraph(GCPushRelabelGraph<TWeight, neighbors> &graph, Size size)
+{
+    graph.create(size.width, size.height);
+}
+
+/**
+ * Undecided pixels are labeled GC_PR_BGD or GC_PR_FGD
+ */
+static inline bool isUndecided(uchar label)
+{
+    return label == GC_PR_BGD || label == GC_PR_FGD;
+}
+
+/**
+ * Part of the image that is segmented by the graph
+ *
+ * GC_BGD and GC_FGD pixels never change their label, so only the bounding box
+ * of the undecided pixels is part of the graph. The vertices of decided pixels
+ * within the box have no edges. The n-links between decided and undecided
+ * pixels are folded into the terminal weights of the undecided ones.
+ *
+ * This makes the decided pixels hard constraints. Before, they were linked to
+ * their terminal with lambda = 9 * gamma, which the cut could still separate if
+ * the n-links of the pixel weighed more. The n-links of the standard pairwise
+ * term never sum to more than about 7 * gamma, so the cut is the same. With the
+ * extended term or large connectivity and contrast weights they can exceed
+ * lambda, and the undecided pixels next to the decided ones may be labeled
+ * differently than before.
+ */
+template <class TWeight>
+struct GraphRegion
+{
+    Rect roi;
+    std::vector<TWeight> sourceW, sinkW;    // folded n-links per vertex
+
+    inline int vtxIdx(Point p) const { return (p.y - roi.y) * roi.width + (p.x - roi.x); }
+};
+
+/**
+ * Returns the bounding box of the undecided pixels, which is empty if there
+ * are none
+ */
+static Rect undecidedBoundingBox(const Mat &mask)
+{
+    int left = mask.cols, right = -1, top = mask.rows, bottom = -1;
+
+    for (int y = 0; y < mask.rows; y++) {
+        const uchar *labels = mask.ptr<uchar>(y);
+        for (int x = 0; x < mask.cols; x++) {
+            if (isUndecided(labels[x])) {
+                left = std::min(left, x);
+                right = std::max(right, x);
+                top = std::min(top, y);
+                bottom = std::max(bottom, y);
+            }
+        }
+    }
+    if (right < 0) {
+        return Rect();
+    }
+    return Rect(left, top, right - left + 1, bottom - top + 1);
+}
+
+/**
+ * Adds the n-link between pixel p and its neighbor q. If only one of them is
+ * undecided, the weight is added to its source or sink weight instead: cutting
+ * the link to a GC_FGD pixel costs the same as cutting the link to the source.
+ */
+template <class TWeight, class Graph>
+static inline void addNLink(const Mat &mask, Point p, Point q, TWeight w, GraphRegion<TWeight> &region,
+                            Graph &graph)
+{
+    const uchar pl = mask.at<uchar>(p), ql = mask.at<uchar>(q);
+
+    if (isUndecided(pl) && isUndecided(ql)) {
+        graph.addEdges(region.vtxIdx(p), region.vtxIdx(q), w, w);
+    } else if (isUndecided(pl)) {
+        (ql == GC_FGD ? region.sourceW : region.sinkW)[region.vtxIdx(p)] += w;
+    } else if (isUndecided(ql)) {
+        (pl == GC_FGD ? region.sourceW : region.sinkW)[region.vtxIdx(q)] += w;
+    }
 }
 
 /**
@@ -668,67 +1552,102 @@ static void learnGMMs(const Mat &img, const Mat &mask, const Mat &compIdxs, GMM
  * 
  * The graph is 8-connected, which means that every pixel/node is connected to each of
  * it neighbors.
- * 
- * @param lambda    weight of the edges connecting foreground/background nodes
- *                  to the source/sink
+ *
+ * The edges between the pixels only depend on the image, so this function adds
+ * them once. The terminal weights are set by setTermWeights() in each
+ * iteration.
+ *
+ * Only the pixels in the region are part of the graph, see GraphRegion.
  */
-static void constructGCGraph(const Mat &img, const Mat &mask, const GMM &bgdGMM, const GMM &fgdGMM,
-                             double lambda, int neighbors,
+template <class TWeight, class Graph>
+static void constructGCGraph(const Mat &mask, int neighbors,
                              const Mat &leftW, const Mat &upleftW, const Mat &upW, const Mat &uprightW,
-                             GCGraph<double> &graph)
+                             GraphRegion<TWeight> &region, Graph &graph)
 {
-    int vtxCount = img.cols * img.rows;
-    int edgeCount = 2 * (4 * img.cols * img.rows - 3 * (img.cols + img.rows) + 2);
-    graph.create(vtxCount, edgeCount);
-    Point p;
-    for (p.y = 0; p.y < img.rows; p.y++) {
-        for (p.x = 0; p.x < img.cols; p.x++) {
-            // add node
-            int vtxIdx = graph.addVtx();
-            Vec3b color = img.at<Vec3b>(p);
+    const Rect &roi = region.roi;
+    createGraph(graph, roi.size());
+    region.sourceW.assign(roi.area(), 0);
+    region.sinkW.assign(roi.area(), 0);
 
-            // 
-            // Unary / data term
-            // 
-            // set t-weights
-            double fromSource, toSink;
-            // we do not know exactly if the pixel is fore- or background, therefore
-            // it is not connected to either the source or the sink 
-            if (mask.at<uchar>(p) == GC_PR_BGD || mask.at<uchar>(p) == GC_PR_FGD) {
-                fromSource = -log(bgdGMM(color));
-                toSink     = -log(fgdGMM(color));
-            }
-            // background pixels are all connected to the sink
-            else if (mask.at<uchar>(p) == GC_BGD) {
-                fromSource = 0;
-                toSink = lambda;
-            }
-            // foreground pixels are all connected to the source
-            else {
-                fromSource = lambda;
-                toSink = 0;
-            }
-            graph.addTermWeights(vtxIdx, fromSource, toSink);
+    // Each pixel adds the links to its left and upper neighbors, so the
+    // pixels below and beside the region add the links into it.
+    const Rect pixels = Rect(roi.x - 1, roi.y, roi.width + 2, roi.height + 1) & Rect(0, 0, mask.cols, mask.rows);
 
+    Point p;
+    for (p.y = pixels.y; p.y < pixels.y + pixels.height; p.y++) {
+        for (p.x = pixels.x; p.x < pixels.x + pixels.width; p.x++) {
             // 
             // Pairwise / binary / smoothing term
             // 
             // set n-weights
             if (p.x > 0) {
-                double w = leftW.at<double>(p);
-                graph.addEdges(vtxIdx, vtxIdx - 1, w, w);
+                addNLink(mask, p, Point(p.x - 1, p.y), leftW.at<TWeight>(p), region, graph);
             }
             if (neighbors == GC_N8 && p.x > 0 && p.y > 0) {
-                double w = upleftW.at<double>(p);
-                graph.addEdges(vtxIdx, vtxIdx - img.cols - 1, w, w);
+                addNLink(mask, p, Point(p.x - 1, p.y - 1), upleftW.at<TWeight>(p), region, graph);
             }
             if (p.y > 0) {
-                double w = upW.at<double>(p);
-                graph.addEdges(vtxIdx, vtxIdx - img.cols, w, w);
+                addNLink(mask, p, Point(p.x, p.y - 1), upW.at<TWeight>(p), region, graph);
+            }
+            if (neighbors == GC_N8 && p.x < mask.cols - 1 && p.y > 0) {
+                addNLink(mask, p, Point(p.x + 1, p.y - 1), uprightW.at<TWeight>(p), region, graph);
+            }
+        }
+    }
+
+    graph.saveCapacities();
+}
+
+/**
+ * Sets the terminal weights for the current GMMs.
+ *
+ * The decided pixels are not connected to the source or the sink, their
+ * n-links are part of the terminal weights of their undecided neighbors.
+ *
+ * @param update    Change the weights in the residual graph of the previous
+ *                  iteration instead of resetting the graph
+ */
+template <class TWeight, class Graph>
+static void setTermWeights(const Mat &mask, const ColorIndex &index, const ColorLikelihoods &cache,
+                           const GraphRegion<TWeight> &region, bool update, Graph &graph)
+{
+    if (!update) {
+        graph.reset();
+    }
+
+    // convert the data terms once per distinct color
+    std::vector<TWeight> bgdTerms(cache.bgdTerms.size()), fgdTerms(cache.fgdTerms.size());
+    for (size_t i = 0; i < bgdTerms.size(); i++) {
+        bgdTerms[i] = Capacity<TWeight>::fromDouble(cache.bgdTerms[i]);
+        fgdTerms[i] = Capacity<TWeight>::fromDouble(cache.fgdTerms[i]);
+    }
+
+    const Rect &roi = region.roi;
+    Point p;
+    for (p.y = roi.y; p.y < roi.y + roi.height; p.y++) {
+        const int *indices = index.indices().ptr<int>(p.y);
+        const uchar *labels = mask.ptr<uchar>(p.y);
+
+        for (p.x = roi.x; p.x < roi.x + roi.width; p.x++) {
+            if (!isUndecided(labels[p.x])) {
+                continue;
             }
-            if (neighbors == GC_N8 && p.x < img.cols - 1 && p.y > 0) {
-                double w = uprightW.at<double>(p);
-                graph.addEdges(vtxIdx, vtxIdx - img.cols + 1, w, w);
+            int vtxIdx = region.vtxIdx(p);
+
+            // 
+            // Unary / data term
+            // 
+            // set t-weights
+            //
+            // we do not know exactly if the pixel is fore- or background, therefore
+            // it is connected to both, the source and the sink
+            TWeight fromSource = bgdTerms[indices[p.x]] + region.sourceW[vtxIdx];
+            TWeight toSink     = fgdTerms[indices[p.x]] + region.sinkW[vtxIdx];
+
+            if (update) {
+                graph.updateTermWeights(vtxIdx, fromSource, toSink);
+            } else {
+                graph.addTermWeights(vtxIdx, fromSource, toSink);
             }
         }
     }
@@ -737,14 +1656,17 @@ static void constructGCGraph(const Mat &img, const Mat &mask, const GMM &bgdGMM,
 /**
  * Estimate segmentation using MaxFlow algorithm
  */
-static void estimateSegmentation(GCGraph<double> &graph, Mat &mask)
+template <class TWeight, class Graph>
+static void estimateSegmentation(Graph &graph, const GraphRegion<TWeight> &region, Mat &mask, bool reuseTrees)
 {
-    graph.maxFlow();
+    graph.maxFlow(reuseTrees);
+
+    const Rect &roi = region.roi;
     Point p;
-    for (p.y = 0; p.y < mask.rows; p.y++) {
-        for (p.x = 0; p.x < mask.cols; p.x++) {
+    for (p.y = roi.y; p.y < roi.y + roi.height; p.y++) {
+        for (p.x = roi.x; p.x < roi.x + roi.width; p.x++) {
             if (mask.at<uchar>(p) == GC_PR_BGD || mask.at<uchar>(p) == GC_PR_FGD) {
-                if (graph.inSourceSegment(p.y * mask.cols + p.x /*vertex index*/)) {
+                if (graph.inSourceSegment(region.vtxIdx(p))) {
                     mask.at<uchar>(p) = GC_PR_FGD;
                 } else {
                     mask.at<uchar>(p) = GC_PR_BGD;
@@ -754,65 +1676,905 @@ static void estimateSegmentation(GCGraph<double> &graph, Mat &mask)
     }
 }
 
-void cv::extendedGrabCut(InputArray _img, InputOutputArray _mask, Rect rect,
-                         InputOutputArray _bgdModel, InputOutputArray _fgdModel,
-                         int iterCount, double tolerance, bool extended,
-                         double connectivity, double contrast,
-                         int neighbors, int mode)
+/**
+ * Runs the iterations of GrabCut with the given type of graph
+ *
+ * All max-flow algorithms share the interface of GCGraph: addEdges(),
+ * addTermWeights() and updateTermWeights() build the graph, maxFlow() computes
+ * the cut, inSourceSegment() reads it, and saveCapacities() and reset() restore
+ * the edges between the pixels for the next iteration.
+ */
+template <class TWeight, class Graph, class Model>
+static void iterateGrabCut(const Mat &img, Mat &mask, Model &bgdGMM, Model &fgdGMM, int iterCount, int neighbors,
+                           const Mat &leftW, const Mat &upleftW, const Mat &upW, const Mat &uprightW,
+                           bool dynamic)
 {
-    Mat img = _img.getMat();
-    Mat &mask = _mask.getMatRef();
-    Mat &bgdModel = _bgdModel.getMatRef();
-    Mat &fgdModel = _fgdModel.getMatRef();
-
-    if (img.empty()) {
-        CV_Error(CV_StsBadArg, "image is empty");
-    }
-    if (img.type() != CV_8UC3) {
-        CV_Error(CV_StsBadArg, "image must have CV_8UC3 type");
+    // the GMMs are evaluated once per distinct color in each iteration
+    const ColorIndex colorIndex(img);
+    ColorLikelihoods cache;
+
+    // the undecided pixels and the edges between them are the same in all
+    // iterations
+    GraphRegion<TWeight> region;
+    region.roi = undecidedBoundingBox(mask);
+
+    Graph graph;
+    if (region.roi.area() > 0) {
+        constructGCGraph(mask, neighbors, leftW, upleftW, upW, uprightW, region, graph);
     }
 
-    GMM bgdGMM(bgdModel), fgdGMM(fgdModel);
-    Mat compIdxs(img.size(), CV_32SC1);
-
-    if (mode == GC_INIT_WITH_RECT || mode == GC_INIT_WITH_MASK) {
-        if (mode == GC_INIT_WITH_RECT) {
-            initMaskWithRect(mask, img.size(), rect);
-        } else { // flag == GC_INIT_WITH_MASK
-            checkMask(img, mask);
+    for (int i = 0; i < iterCount; i++) {
+        // only the terminal weights change between the iterations, so the
+        // flow of the previous one can be reused
+        const bool reuse = dynamic && i > 0;
+
+        assignAndLearnGMMs(img, mask, colorIndex, bgdGMM, fgdGMM, cache);
+        if (region.roi.area() > 0) {
+            setTermWeights(mask, colorIndex, cache, region, reuse, graph);
+            estimateSegmentation(graph, region, mask, reuse);
         }
-        initGMMs(img, mask, tolerance, bgdGMM, fgdGMM);
-    }
-
-    if (iterCount <= 0) {
-        return;
     }
+}
 
-    // if we do not initialize the mask, check it for consistency
-    if (mode == GC_EVAL) {
-        checkMask(img, mask);
+/**
+ * Selects the grid graph of the max-flow algorithm for the neighborhood system
+ */
+template <class TWeight, template <class, int> class GridGraph, class Model>
+static void iterateGrabCutOnGrid(const Mat &img, Mat &mask, Model &bgdGMM, Model &fgdGMM, int iterCount,
+                                 int neighbors, const Mat &leftW, const Mat &upleftW, const Mat &upW, const Mat &uprightW,
+                                 bool dynamic)
+{
+    // the neighbors of the pixels are implicit in the grid graphs
+    if (neighbors == GC_N8) {
+        iterateGrabCut<TWeight, GridGraph<TWeight, GC_N8> >(img, mask, bgdGMM, fgdGMM, iterCount, neighbors,
+                                                            leftW, upleftW, upW, uprightW, dynamic);
+    } else {
+        iterateGrabCut<TWeight, GridGraph<TWeight, GC_N4> >(img, mask, bgdGMM, fgdGMM, iterCount, neighbors,
+                                                            leftW, upleftW, upW, uprightW, dynamic);
     }
+}
 
-    const double gamma = 50;
-    const double lambda = 9 * gamma;
-
+/**
+ * Undecided pixels in the band, which are the vertices of the band graph. They
+ * are stored in row-major order, so the vertex of a pixel is found by binary
+ * search.
+ */
+struct BandPixels
+{
+    std::vector<int> offsets;       // y * cols + x
+    std::vector<Vec3b> colors;
+
+    inline int vtxIdx(int offset) const
+    {
+        std::vector<int>::const_iterator it = std::lower_bound(offsets.begin(), offsets.end(), offset);
+        return it != offsets.end() && *it == offset ? (int) (it - offsets.begin()) : -1;
+    }
+};
+
+/**
+ * Adds the square with the given radius around a boundary pixel to the rows
+ * it covers
+ */
+static inline void addBandSquare(int x, int y, int radius, std::vector<std::vector<int> > &rows)
+{
+    const int last = std::min(y + radius, (int) rows.size() - 1);
+    for (int row = std::max(y - radius, 0); row <= last; row++) {
+        rows[row].push_back(x);
+    }
+}
+
+/**
+ * Collects the undecided pixels within the radius of the boundary between
+ * foreground and background. The band is the union of the squares around the
+ * boundary pixels, the same as dilating the boundary radius times with a 3x3
+ * kernel. It is merged row by row from the x coordinates of the squares, so
+ * after one pass over the labels to find the boundary only the band is
+ * visited.
+ */
+static void boundaryBand(const Mat &img, const Mat &mask, int radius, BandPixels &pixels)
+{
+    // x coordinates of the boundary pixels whose square covers each row
+    std::vector<std::vector<int> > rows(mask.rows);
+
+    for (int y = 0; y < mask.rows; y++) {
+        const uchar *labels = mask.ptr<uchar>(y);
+        const uchar *below = y < mask.rows - 1 ? mask.ptr<uchar>(y + 1) : 0;
+
+        // the lowest bit of the labels is set for the foreground
+        for (int x = 0; x < mask.cols; x++) {
+            if (x < mask.cols - 1 && ((labels[x] ^ labels[x + 1]) & 1)) {
+                addBandSquare(x, y, radius, rows);
+                addBandSquare(x + 1, y, radius, rows);
+            }
+            if (below && ((labels[x] ^ below[x]) & 1)) {
+                addBandSquare(x, y, radius, rows);
+                addBandSquare(x, y + 1, radius, rows);
+            }
+        }
+    }
+
+    for (int y = 0; y < mask.rows; y++) {
+        std::vector<int> &xs = rows[y];
+        std::sort(xs.begin(), xs.end());
+
+        const uchar *labels = mask.ptr<uchar>(y);
+        const Vec3b *colors = img.ptr<Vec3b>(y);
+
+        // merge the overlapping intervals [x - radius, x + radius]
+        size_t k = 0;
+        while (k < xs.size()) {
+            const int start = std::max(xs[k] - radius, 0);
+            int end = xs[k] + radius;
+            while (++k < xs.size() && xs[k] - radius <= end + 1) {
+                end = xs[k] + radius;
+            }
+            end = std::min(end, mask.cols - 1);
+
+            for (int x = start; x <= end; x++) {
+                if (isUndecided(labels[x])) {
+                    pixels.offsets.push_back(y * mask.cols + x);
+                    pixels.colors.push_back(colors[x]);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Calculates beta of the pairwise term like calcBeta(), but only from the
+ * edges with at least one end in the band. Recalculating it from the whole
+ * image would make each refinement cost as much as a full-resolution pass.
+ * The band contains the color differences across the boundary, so this beta
+ * tends to be smaller than the one of the whole image and the n-links of the
+ * band depend less on the contrast.
+ */
+static double bandBeta(const Mat &img, const BandPixels &pixels, bool extended, int neighbors)
+{
+    double sum = 0;
+    int edges = 0;
+
+    for (int i = 0; i < (int) pixels.offsets.size(); i++) {
+        const Point p(pixels.offsets[i] % img.cols, pixels.offsets[i] / img.cols);
+
+        for (int d = 0; d < neighbors; d++) {
+            const Point q(p.x + gcGridDx[d], p.y + gcGridDy[d]);
+            if (q.x < 0 || q.x >= img.cols || q.y < 0 || q.y >= img.rows) {
+                continue;
+            }
+
+            // an edge between two band pixels is counted by the later one
+            if (pixels.vtxIdx(q.y * img.cols + q.x) > i) {
+                continue;
+            }
+
+            const int dist = sqrColorDist(img.at<Vec3b>(p), img.at<Vec3b>(q));
+            sum += extended ? std::sqrt((double) dist) : dist;
+            edges++;
+        }
+    }
+
+    double beta = 0;
+    if (sum > std::numeric_limits<double>::epsilon()) {
+        beta = extended ? 2.f / (sum / edges) : 1.f / (2 * sum / edges);
+    }
+    return beta;
+}
+
+/**
+ * Segments the undecided pixels within the radius of the boundary of the mask
+ * again with one min-cut. All other pixels keep their label; the n-links to
+ * them are folded into the terminal weights of the band pixels, as in
+ * addNLink(). Only the band pixels are evaluated in the GMMs and only their
+ * n-weights are calculated, with beta from the edges of the band, see
+ * bandBeta().
+ */
+template <class TWeight, class Model>
+static void refineBand(const Mat &img, Mat &mask, const Model &bgdGMM, const Model &fgdGMM,
+                       bool extended, double connectivity, double contrast, int neighbors, int radius)
+{
+    BandPixels pixels;
+    boundaryBand(img, mask, radius, pixels);
+
+    const int count = (int) pixels.offsets.size();
+    if (count == 0) {
+        return;
+    }
+
+    std::vector<double> bgdTerms(count), fgdTerms(count);
+    evaluateColors(bgdGMM, pixels.colors, &bgdTerms[0], 0);
+    evaluateColors(fgdGMM, pixels.colors, &fgdTerms[0], 0);
+
+    const double beta = bandBeta(img, pixels, extended, neighbors);
+    const double gammaDivSqrt2 = pairwiseGamma / std::sqrt(2.0f);
+
+    GCGraph<TWeight> graph(count, count * neighbors);
+    std::vector<TWeight> sourceW(count, 0), sinkW(count, 0);
+    for (int i = 0; i < count; i++) {
+        graph.addVtx();
+    }
+
+    for (int i = 0; i < count; i++) {
+        const Point p(pixels.offsets[i] % mask.cols, pixels.offsets[i] / mask.cols);
+
+        for (int d = 0; d < neighbors; d++) {
+            const Point q(p.x + gcGridDx[d], p.y + gcGridDy[d]);
+            if (q.x < 0 || q.x >= mask.cols || q.y < 0 || q.y >= mask.rows) {
+                continue;
+            }
+
+            // the edge between two band pixels is added by the later one
+            const int j = pixels.vtxIdx(q.y * mask.cols + q.x);
+            if (j > i) {
+                continue;
+            }
+
+            const double scale = gcGridDx[d] != 0 && gcGridDy[d] != 0 ? gammaDivSqrt2 : pairwiseGamma;
+            const TWeight w = Capacity<TWeight>::fromDouble(
+                pairwiseWeight(sqrColorDist(img.at<Vec3b>(p), img.at<Vec3b>(q)), scale, extended, beta,
+                               connectivity, contrast));
+
+            if (j >= 0) {
+                graph.addEdges(i, j, w, w);
+            } else {
+                ((mask.at<uchar>(q) & 1) ? sourceW : sinkW)[i] += w;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        graph.addTermWeights(i, Capacity<TWeight>::fromDouble(bgdTerms[i]) + sourceW[i],
+                             Capacity<TWeight>::fromDouble(fgdTerms[i]) + sinkW[i]);
+    }
+
+    graph.maxFlow();
+
+    for (int i = 0; i < count; i++) {
+        const Point p(pixels.offsets[i] % mask.cols, pixels.offsets[i] / mask.cols);
+        mask.at<uchar>(p) = graph.inSourceSegment(i) ? GC_PR_FGD : GC_PR_BGD;
+    }
+}
+
+// iterations of the k-means clustering of the superpixels
+static const int slicIterations = 3;
+
+// Weight of the spatial distance relative to the color distance of SLIC. The
+// BGR distances are larger than the Lab distances of the original, and noisy
+// images need compact superpixels.
+static const double slicCompactness = 80;
+
+/**
+ * Cluster center of a SLIC superpixel
+ */
+struct SlicCenter
+{
+    SlicCenter() : x(0), y(0) {}
+
+    double x, y;
+    Vec3d color;
+};
+
+/**
+ * Assignment step of SLIC. Each pixel joins the closest of the centers that
+ * started in its grid cell and in the 8 cells around it. The distance adds
+ * the squared color distance and the weighted squared spatial distance.
+ */
+class AssignSuperpixels : public ParallelLoopBody
+{
+  public:
+    AssignSuperpixels(const Mat &_img, const std::vector<SlicCenter> &_centers, Size _grid, int _size,
+                      Mat &_labels) :
+        img(_img), centers(_centers), grid(_grid), size(_size), labels(_labels)
+    {}
+
+    void operator()(const Range &rows) const
+    {
+        const float spatialWeight = (float) ((slicCompactness / size) * (slicCompactness / size));
+
+        for (int y = rows.start; y < rows.end; y++) {
+            const Vec3b *colors = img.ptr<Vec3b>(y);
+            int *superpixels = labels.ptr<int>(y);
+            const int gy = y * grid.height / img.rows;
+
+            // the pixels of a grid cell share the candidate centers
+            for (int gx = 0, x = 0; gx < grid.width; gx++) {
+                int candidates[9], count = 0;
+                float cx[9], b[9], g[9], r[9], rowDist[9];
+
+                for (int ny = std::max(gy - 1, 0); ny <= std::min(gy + 1, grid.height - 1); ny++) {
+                    for (int nx = std::max(gx - 1, 0); nx <= std::min(gx + 1, grid.width - 1); nx++) {
+                        const SlicCenter &c = centers[ny * grid.width + nx];
+                        candidates[count] = ny * grid.width + nx;
+                        cx[count] = (float) c.x;
+                        b[count] = (float) c.color[0];
+                        g[count] = (float) c.color[1];
+                        r[count] = (float) c.color[2];
+                        rowDist[count] = spatialWeight * (float) ((y - c.y) * (y - c.y));
+                        count++;
+                    }
+                }
+
+                for (const int end = ((gx + 1) * img.cols + grid.width - 1) / grid.width; x < end; x++) {
+                    float best = std::numeric_limits<float>::max();
+                    int closest = candidates[0];
+
+                    for (int k = 0; k < count; k++) {
+                        const float d0 = colors[x][0] - b[k];
+                        const float d1 = colors[x][1] - g[k];
+                        const float d2 = colors[x][2] - r[k];
+                        const float dx = x - cx[k];
+                        const float dist = d0 * d0 + d1 * d1 + d2 * d2 + spatialWeight * dx * dx + rowDist[k];
+
+                        if (dist < best) {
+                            best = dist;
+                            closest = candidates[k];
+                        }
+                    }
+                    superpixels[x] = closest;
+                }
+            }
+        }
+    }
+
+  private:
+    const Mat &img;
+    const std::vector<SlicCenter> &centers;
+    const Size grid;
+    const int size;
+    Mat &labels;
+};
+
+/**
+ * Clusters the pixels into superpixels of about size x size pixels with SLIC
+ * (Achanta et al., 2012), using the BGR colors
+ */
+static void slicSuperpixels(const Mat &img, int size, Mat &labels)
+{
+    const Size grid(std::max(img.cols / size, 1), std::max(img.rows / size, 1));
+
+    std::vector<SlicCenter> centers(grid.area());
+    for (int gy = 0; gy < grid.height; gy++) {
+        for (int gx = 0; gx < grid.width; gx++) {
+            SlicCenter &c = centers[gy * grid.width + gx];
+            c.x = (gx + 0.5) * img.cols / grid.width;
+            c.y = (gy + 0.5) * img.rows / grid.height;
+
+            const Vec3b color = img.at<Vec3b>((int) c.y, (int) c.x);
+            c.color = Vec3d(color[0], color[1], color[2]);
+        }
+    }
+
+    labels.create(img.size(), CV_32SC1);
+
+    for (int i = 0; i < slicIterations; i++) {
+        parallel_for_(Range(0, img.rows), AssignSuperpixels(img, centers, grid, size, labels));
+
+        // move the centers to the mean of their pixels, empty clusters keep
+        // their center
+        std::vector<SlicCenter> sums(centers.size());
+        std::vector<int> counts(centers.size(), 0);
+
+        for (int y = 0; y < img.rows; y++) {
+            const Vec3b *colors = img.ptr<Vec3b>(y);
+            const int *superpixels = labels.ptr<int>(y);
+
+            for (int x = 0; x < img.cols; x++) {
+                SlicCenter &sum = sums[superpixels[x]];
+                sum.x += x;
+                sum.y += y;
+                sum.color += Vec3d(colors[x][0], colors[x][1], colors[x][2]);
+                counts[superpixels[x]]++;
+            }
+        }
+        for (size_t c = 0; c < centers.size(); c++) {
+            if (counts[c] > 0) {
+                centers[c].x = sums[c].x / counts[c];
+                centers[c].y = sums[c].y / counts[c];
+                centers[c].color = sums[c].color * (1.0 / counts[c]);
+            }
+        }
+    }
+}
+
+/**
+ * The hard constraints of a pixel: GC_BGD, GC_FGD or GC_PR_BGD for all
+ * undecided pixels
+ */
+static inline uchar constraintOf(uchar label)
+{
+    return isUndecided(label) ? (uchar) GC_PR_BGD : label;
+}
+
+/**
+ * Splits the SLIC clusters into connected superpixels whose pixels have the
+ * same hard constraint. Superpixels smaller than minSize are merged into an
+ * adjacent one with the same constraint, as in the connectivity step of SLIC.
+ *
+ * @return  the number of superpixels
+ */
+static int connectSuperpixels(const Mat &clusters, const Mat &mask, int minSize, Mat &labels)
+{
+    static const int dx[4] = { -1, 1, 0, 0 };
+    static const int dy[4] = { 0, 0, -1, 1 };
+
+    labels.create(clusters.size(), CV_32SC1);
+    labels.setTo(Scalar::all(-1));
+
+    int count = 0;
+    std::vector<Point> pixels;
+
+    for (int y = 0; y < labels.rows; y++) {
+        for (int x = 0; x < labels.cols; x++) {
+            if (labels.at<int>(y, x) >= 0) {
+                continue;
+            }
+            const int cluster = clusters.at<int>(y, x);
+            const uchar constraint = constraintOf(mask.at<uchar>(y, x));
+
+            // the left and upper neighbors are labeled already
+            int adjacent = -1;
+            if (x > 0 && constraintOf(mask.at<uchar>(y, x - 1)) == constraint) {
+                adjacent = labels.at<int>(y, x - 1);
+            } else if (y > 0 && constraintOf(mask.at<uchar>(y - 1, x)) == constraint) {
+                adjacent = labels.at<int>(y - 1, x);
+            }
+
+            // flood fill the connected pixels of the cluster
+            pixels.clear();
+            pixels.push_back(Point(x, y));
+            labels.at<int>(y, x) = count;
+
+            for (size_t i = 0; i < pixels.size(); i++) {
+                for (int d = 0; d < 4; d++) {
+                    const Point q(pixels[i].x + dx[d], pixels[i].y + dy[d]);
+                    if (q.x < 0 || q.x >= labels.cols || q.y < 0 || q.y >= labels.rows
+                        || labels.at<int>(q) >= 0 || clusters.at<int>(q) != cluster
+                        || constraintOf(mask.at<uchar>(q)) != constraint) {
+                        continue;
+                    }
+                    labels.at<int>(q) = count;
+                    pixels.push_back(q);
+                }
+            }
+
+            if ((int) pixels.size() < minSize && adjacent >= 0) {
+                for (size_t i = 0; i < pixels.size(); i++) {
+                    labels.at<int>(pixels[i]) = adjacent;
+                }
+            } else {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+/**
+ * Adds the weight of an n-link between two pixels to the link between their
+ * superpixels. Links to superpixels with a hard constraint are folded into
+ * the terminal weights, as in addNLink().
+ */
+template <class TWeight>
+static inline void addSuperpixelLink(int a, int b, TWeight w, const std::vector<int> &vertices,
+                                     const std::vector<uchar> &constraints,
+                                     std::vector<std::vector<std::pair<int, TWeight> > > &links,
+                                     std::vector<TWeight> &sourceW, std::vector<TWeight> &sinkW)
+{
+    if (a == b || w == 0) {
+        return;
+    }
+    const int i = vertices[a], j = vertices[b];
+
+    if (i >= 0 && j >= 0) {
+        std::vector<std::pair<int, TWeight> > &adjacent = links[std::min(i, j)];
+        const int other = std::max(i, j);
+
+        // superpixels have only a few neighbors
+        size_t k = 0;
+        while (k < adjacent.size() && adjacent[k].first != other) {
+            k++;
+        }
+        if (k < adjacent.size()) {
+            adjacent[k].second += w;
+        } else {
+            adjacent.push_back(std::make_pair(other, w));
+        }
+    } else if (i >= 0) {
+        (constraints[b] == GC_FGD ? sourceW : sinkW)[i] += w;
+    } else if (j >= 0) {
+        (constraints[a] == GC_FGD ? sourceW : sinkW)[j] += w;
+    }
+}
+
+/**
+ * Runs the iterations of GrabCut on a graph of superpixels
+ *
+ * Each undecided superpixel is one vertex. Its data terms are the sums of the
+ * data terms of its pixels, and the weight of the edge between two
+ * superpixels is the sum of the n-weights of the pixels along their common
+ * boundary, so the cut has the same energy as the pixel graph restricted to
+ * labelings that are constant on the superpixels. The GMMs are learned from
+ * the pixels as usual.
+ *
+ * If refine is set, the pixels around the boundary of the segmentation are
+ * segmented again in the end, see refineBand().
+ */
+template <class TWeight, class Model>
+static void iterateSuperpixelGrabCut(const Mat &img, Mat &mask, Model &bgdGMM, Model &fgdGMM, int iterCount,
+                                     bool extended, double connectivity, double contrast, int neighbors,
+                                     const Mat &leftW, const Mat &upleftW, const Mat &upW, const Mat &uprightW,
+                                     bool dynamic, int size, bool refine)
+{
+    Mat clusters, labels;
+    slicSuperpixels(img, size, clusters);
+    const int count = connectSuperpixels(clusters, mask, size * size / 4, labels);
+
+    // the vertex of each undecided superpixel
+    std::vector<uchar> constraints(count);
+    for (int y = 0; y < mask.rows; y++) {
+        const uchar *pixelLabels = mask.ptr<uchar>(y);
+        const int *superpixels = labels.ptr<int>(y);
+
+        for (int x = 0; x < mask.cols; x++) {
+            constraints[superpixels[x]] = constraintOf(pixelLabels[x]);
+        }
+    }
+
+    std::vector<int> vertices(count, -1);
+    int vtxCount = 0;
+    for (int s = 0; s < count; s++) {
+        if (constraints[s] == GC_PR_BGD) {
+            vertices[s] = vtxCount++;
+        }
+    }
+
+    std::vector<std::vector<std::pair<int, TWeight> > > links(vtxCount);
+    std::vector<TWeight> sourceW(vtxCount, 0), sinkW(vtxCount, 0);
+
+    for (int y = 0; y < mask.rows; y++) {
+        const int *superpixels = labels.ptr<int>(y);
+        const int *upper = y > 0 ? labels.ptr<int>(y - 1) : 0;
+
+        for (int x = 0; x < mask.cols; x++) {
+            const int s = superpixels[x];
+            if (x > 0) {
+                addSuperpixelLink(s, superpixels[x - 1], leftW.at<TWeight>(y, x), vertices, constraints,
+                                  links, sourceW, sinkW);
+            }
+            if (upper) {
+                addSuperpixelLink(s, upper[x], upW.at<TWeight>(y, x), vertices, constraints,
+                                  links, sourceW, sinkW);
+            }
+            if (neighbors == GC_N8 && upper && x > 0) {
+                addSuperpixelLink(s, upper[x - 1], upleftW.at<TWeight>(y, x), vertices, constraints,
+                                  links, sourceW, sinkW);
+            }
+            if (neighbors == GC_N8 && upper && x < mask.cols - 1) {
+                addSuperpixelLink(s, upper[x + 1], uprightW.at<TWeight>(y, x), vertices, constraints,
+                                  links, sourceW, sinkW);
+            }
+        }
+    }
+
+    int edgeCount = 0;
+    for (int i = 0; i < vtxCount; i++) {
+        edgeCount += 2 * (int) links[i].size();
+    }
+
+    GCGraph<TWeight> graph(vtxCount, edgeCount);
+    for (int i = 0; i < vtxCount; i++) {
+        graph.addVtx();
+    }
+    for (int i = 0; i < vtxCount; i++) {
+        for (size_t k = 0; k < links[i].size(); k++) {
+            graph.addEdges(i, links[i][k].first, links[i][k].second, links[i][k].second);
+        }
+    }
+    graph.saveCapacities();
+
+    const ColorIndex colorIndex(img);
+    ColorLikelihoods cache;
+    std::vector<double> bgdTerms(vtxCount), fgdTerms(vtxCount);
+
+    for (int i = 0; i < iterCount && vtxCount > 0; i++) {
+        const bool reuse = dynamic && i > 0;
+
+        assignAndLearnGMMs(img, mask, colorIndex, bgdGMM, fgdGMM, cache);
+
+        std::fill(bgdTerms.begin(), bgdTerms.end(), 0.0);
+        std::fill(fgdTerms.begin(), fgdTerms.end(), 0.0);
+        for (int y = 0; y < mask.rows; y++) {
+            const int *indices = colorIndex.indices().ptr<int>(y);
+            const int *superpixels = labels.ptr<int>(y);
+
+            for (int x = 0; x < mask.cols; x++) {
+                const int v = vertices[superpixels[x]];
+                if (v >= 0) {
+                    bgdTerms[v] += cache.bgdTerms[indices[x]];
+                    fgdTerms[v] += cache.fgdTerms[indices[x]];
+                }
+            }
+        }
+
+        if (!reuse) {
+            graph.reset();
+        }
+        for (int v = 0; v < vtxCount; v++) {
+            const TWeight fromSource = Capacity<TWeight>::fromDouble(bgdTerms[v]) + sourceW[v];
+            const TWeight toSink = Capacity<TWeight>::fromDouble(fgdTerms[v]) + sinkW[v];
+
+            if (reuse) {
+                graph.updateTermWeights(v, fromSource, toSink);
+            } else {
+                graph.addTermWeights(v, fromSource, toSink);
+            }
+        }
+
+        graph.maxFlow(reuse);
+
+        for (int y = 0; y < mask.rows; y++) {
+            uchar *pixelLabels = mask.ptr<uchar>(y);
+            const int *superpixels = labels.ptr<int>(y);
+
+            for (int x = 0; x < mask.cols; x++) {
+                const int v = vertices[superpixels[x]];
+                if (v >= 0) {
+                    pixelLabels[x] = graph.inSourceSegment(v) ? GC_PR_FGD : GC_PR_BGD;
+                }
+            }
+        }
+    }
+
+    if (refine && iterCount > 0) {
+        refineBand<TWeight>(img, mask, bgdGMM, fgdGMM, extended, connectivity, contrast, neighbors,
+                            std::max(size / 2, 1));
+    }
+}
+
+/**
+ * Calculates the n-weights with the capacity type TWeight and runs the
+ * iterations with the graph of the max-flow algorithm, or with the graph of
+ * the superpixels if superpixelSize is positive
+ */
+template <class TWeight, class Model>
+static void runGrabCut(const Mat &img, Mat &mask, Model &bgdGMM, Model &fgdGMM, int iterCount,
+                       bool extended, double connectivity, double contrast,
+                       int neighbors, bool dynamic, int maxflow, int superpixelSize, bool refineSuperpixels)
+{
     Mat leftW, upleftW, upW, uprightW;
-    
-    if (extended) {
-        const double beta = calcExtendedBeta(img, neighbors);
-        calcExtendedNWeights(img, leftW, upleftW, upW, uprightW, beta, connectivity, contrast, neighbors);
-    } else {
-        const double beta = calcBeta(img, neighbors);
-        calcNWeights(img, leftW, upleftW, upW, uprightW, beta, gamma, neighbors);
+
+    calcNWeights<TWeight>(img, leftW, upleftW, upW, uprightW, pairwiseGamma, extended, connectivity, contrast,
+                          neighbors);
+
+    if (superpixelSize > 0) {
+        iterateSuperpixelGrabCut<TWeight>(img, mask, bgdGMM, fgdGMM, iterCount, extended, connectivity, contrast,
+                                          neighbors, leftW, upleftW, upW, uprightW, dynamic, superpixelSize,
+                                          refineSuperpixels);
+        return;
+    }
+
+    switch (maxflow) {
+        case GC_MAXFLOW_BK:
+            iterateGrabCutOnGrid<TWeight, GCGridGraph>(img, mask, bgdGMM, fgdGMM, iterCount, neighbors,
+                                                       leftW, upleftW, upW, uprightW, dynamic);
+            break;
+        case GC_MAXFLOW_IBFS:
+            iterateGrabCutOnGrid<TWeight, GCIBFSGraph>(img, mask, bgdGMM, fgdGMM, iterCount, neighbors,
+                                                       leftW, upleftW, upW, uprightW, dynamic);
+            break;
+        case GC_MAXFLOW_PUSH_RELABEL:
+            iterateGrabCutOnGrid<TWeight, GCPushRelabelGraph>(img, mask, bgdGMM, fgdGMM, iterCount, neighbors,
+                                                              leftW, upleftW, upW, uprightW, dynamic);
+            break;
     }
+}
 
+// The boundary of a pyramid level is accurate to one of its pixels, which are
+// two pixels of the next finer level. The band around it is a bit wider.
+static const int pyramidBandRadius = 3;
 
-    for (int i = 0; i < iterCount; i++) {
-        GCGraph<double> graph;
-        assignGMMsComponents(img, mask, bgdGMM, fgdGMM, compIdxs);
-        learnGMMs(img, mask, compIdxs, bgdGMM, fgdGMM);
-        constructGCGraph(img, mask, bgdGMM, fgdGMM, lambda, neighbors,
-                         leftW, upleftW, upW, uprightW, graph);
-        estimateSegmentation(graph, mask);
+// the coarsest pyramid level is at least this wide and high
+static const int minPyramidSize = 32;
+
+/**
+ * Replaces the undecided labels of a pyramid level by the segmentation of the
+ * next coarser level
+ */
+static void upsampleSegmentation(const Mat &coarse, Mat &mask)
+{
+    Mat upsampled;
+    resize(coarse, upsampled, mask.size(), 0, 0, INTER_NEAREST);
+
+    for (int y = 0; y < mask.rows; y++) {
+        uchar *labels = mask.ptr<uchar>(y);
+        const uchar *coarseLabels = upsampled.ptr<uchar>(y);
+
+        for (int x = 0; x < mask.cols; x++) {
+            if (isUndecided(labels[x])) {
+                labels[x] = (coarseLabels[x] & 1) ? GC_PR_FGD : GC_PR_BGD;
+            }
+        }
+    }
+}
+
+template <class Model>
+static void grabCut(const Mat &img, Mat &mask, Rect rect, Model &bgdGMM, Model &fgdGMM, int iterCount,
+                    double tolerance, bool extended, double connectivity, double contrast,
+                    int neighbors, int mode, const GrabCutOptions &options);
+
+/**
+ * Coarse-to-fine GrabCut
+ *
+ * The GMMs are learned and all iterations run on the coarsest level of an
+ * image pyramid. On each finer level the segmentation of the coarser one is
+ * upsampled and only a narrow band around its boundary is segmented again
+ * with the same GMMs, see refineBand(). The hard labels of the mask are
+ * downsampled to each level, so they are kept on all of them.
+ *
+ * Apart from building the pyramid and upsampling the labels, the finer levels
+ * cost time in proportion to their bands.
+ */
+template <class Model>
+static void pyramidGrabCut(const Mat &img, Mat &mask, Model &bgdGMM, Model &fgdGMM, int iterCount,
+                           double tolerance, bool extended, double connectivity, double contrast,
+                           int neighbors, int mode, const GrabCutOptions &options)
+{
+    // level 0 shares the data of the mask
+    std::vector<Mat> images(1, img), masks(1, mask);
+    while ((int) images.size() < options.pyramid && std::min(images.back().cols, images.back().rows) >= 2 * minPyramidSize) {
+        Mat image, labels;
+        pyrDown(images.back(), image);
+        resize(masks.back(), labels, image.size(), 0, 0, INTER_NEAREST);
+        images.push_back(image);
+        masks.push_back(labels);
+    }
+
+    GrabCutOptions coarsest = options;
+    coarsest.pyramid = 1;
+
+    Mat segmentation = masks.back().clone();
+    grabCut(images.back(), segmentation, Rect(), bgdGMM, fgdGMM, iterCount, tolerance, extended,
+            connectivity, contrast, neighbors, mode, coarsest);
+
+    if (iterCount <= 0) {
+        return;
+    }
+    if (images.size() == 1) {
+        segmentation.copyTo(mask);
+        return;
+    }
+
+    for (int level = (int) images.size() - 2; level >= 0; level--) {
+        upsampleSegmentation(segmentation, masks[level]);
+
+        switch (options.weightType) {
+            case CV_64F:
+                refineBand<double>(images[level], masks[level], bgdGMM, fgdGMM, extended, connectivity,
+                                   contrast, neighbors, pyramidBandRadius);
+                break;
+            case CV_32F:
+                refineBand<float>(images[level], masks[level], bgdGMM, fgdGMM, extended, connectivity,
+                                  contrast, neighbors, pyramidBandRadius);
+                break;
+            case CV_32S:
+                refineBand<int>(images[level], masks[level], bgdGMM, fgdGMM, extended, connectivity,
+                                contrast, neighbors, pyramidBandRadius);
+                break;
+        }
+        segmentation = masks[level];
+    }
+}
+
+/**
+ * Runs GrabCut with the GMMs or histograms after the arguments are checked
+ */
+template <class Model>
+static void grabCut(const Mat &img, Mat &mask, Rect rect, Model &bgdGMM, Model &fgdGMM, int iterCount,
+                    double tolerance, bool extended, double connectivity, double contrast,
+                    int neighbors, int mode, const GrabCutOptions &options)
+{
+    if (options.pyramid > 1) {
+        // the levels are downsampled from the initialized mask
+        if (mode == GC_INIT_WITH_RECT) {
+            initMaskWithRect(mask, img.size(), rect);
+        } else {
+            checkMask(img, mask);
+        }
+        pyramidGrabCut(img, mask, bgdGMM, fgdGMM, iterCount, tolerance, extended, connectivity, contrast,
+                       neighbors, mode == GC_EVAL ? GC_EVAL : GC_INIT_WITH_MASK, options);
+        return;
+    }
+
+    if (mode == GC_INIT_WITH_RECT || mode == GC_INIT_WITH_MASK) {
+        if (mode == GC_INIT_WITH_RECT) {
+            initMaskWithRect(mask, img.size(), rect);
+        } else { // flag == GC_INIT_WITH_MASK
+            checkMask(img, mask);
+        }
+        initModels(img, mask, tolerance, options.initSamples, bgdGMM, fgdGMM);
+    }
+
+    if (iterCount <= 0) {
+        return;
+    }
+
+    // if we do not initialize the mask, check it for consistency
+    if (mode == GC_EVAL) {
+        checkMask(img, mask);
+    }
+
+    switch (options.weightType) {
+        case CV_64F:
+            runGrabCut<double>(img, mask, bgdGMM, fgdGMM, iterCount, extended, connectivity, contrast,
+                               neighbors, options.dynamic, options.maxflow, options.superpixelSize,
+                               options.refineSuperpixels);
+            break;
+        case CV_32F:
+            runGrabCut<float>(img, mask, bgdGMM, fgdGMM, iterCount, extended, connectivity, contrast,
+                              neighbors, options.dynamic, options.maxflow, options.superpixelSize,
+                              options.refineSuperpixels);
+            break;
+        case CV_32S:
+            runGrabCut<int>(img, mask, bgdGMM, fgdGMM, iterCount, extended, connectivity, contrast,
+                            neighbors, options.dynamic, options.maxflow, options.superpixelSize,
+                            options.refineSuperpixels);
+            break;
+    }
+}
+
+void cv::extendedGrabCut(InputArray _img, InputOutputArray _mask, Rect rect,
+                         InputOutputArray _bgdModel, InputOutputArray _fgdModel,
+                         int iterCount, double tolerance, bool extended,
+                         double connectivity, double contrast,
+                         int neighbors, int mode, const GrabCutOptions &options)
+{
+    Mat img = _img.getMat();
+    Mat &mask = _mask.getMatRef();
+    Mat &bgdModel = _bgdModel.getMatRef();
+    Mat &fgdModel = _fgdModel.getMatRef();
+
+    if (img.empty()) {
+        CV_Error(CV_StsBadArg, "image is empty");
+    }
+    if (img.type() != CV_8UC3) {
+        CV_Error(CV_StsBadArg, "image must have CV_8UC3 type");
+    }
+    if (options.maxflow != GC_MAXFLOW_BK && options.maxflow != GC_MAXFLOW_IBFS &&
+        options.maxflow != GC_MAXFLOW_PUSH_RELABEL) {
+        CV_Error(CV_StsBadArg, "unknown max-flow algorithm");
+    }
+    if (options.weightType != CV_64F && options.weightType != CV_32F && options.weightType != CV_32S) {
+        CV_Error(CV_StsBadArg, "weightType must be CV_64F, CV_32F or CV_32S");
+    }
+    if (options.pyramid < 1) {
+        CV_Error(CV_StsBadArg, "pyramid must have at least one level");
+    }
+    if (options.superpixelSize < 0) {
+        CV_Error(CV_StsBadArg, "superpixelSize must not be negative");
+    }
+    if (options.colorModel != GC_COLOR_GMM && options.colorModel != GC_COLOR_HISTOGRAM) {
+        CV_Error(CV_StsBadArg, "unknown color model");
+    }
+    if (options.colorModel == GC_COLOR_HISTOGRAM &&
+        (options.histogramBins < 1 || options.histogramBins > ColorHistogram::maxBins)) {
+        CV_Error(CV_StsBadArg, "histogramBins must be between 1 and 32");
+    }
+    if (options.colorModel == GC_COLOR_HISTOGRAM && options.histogramSmoothing <= 0) {
+        CV_Error(CV_StsBadArg, "histogramSmoothing must be positive");
+    }
+    if (options.initSamples < 0) {
+        CV_Error(CV_StsBadArg, "initSamples must not be negative");
+    }
+
+    if (options.colorModel == GC_COLOR_HISTOGRAM) {
+        ColorHistogram bgdHist(bgdModel, options.histogramBins, options.histogramSmoothing);
+        ColorHistogram fgdHist(fgdModel, options.histogramBins, options.histogramSmoothing);
+
+        grabCut(img, mask, rect, bgdHist, fgdHist, iterCount, tolerance, extended, connectivity, contrast,
+                neighbors, mode, options);
+    } else {
+        GMM bgdGMM(bgdModel), fgdGMM(fgdModel);
+
+        grabCut(img, mask, rect, bgdGMM, fgdGMM, iterCount, tolerance, extended, connectivity, contrast,
+                neighbors, mode, options);
     }
 }
@@ -16,9 +16,90 @@ enum
     GC_N8 = 8,
 };
 
+/**
+ * Max-flow algorithms for the min-cut calculation
+ */
+enum
+{
+    GC_MAXFLOW_BK = 0,              // Boykov-Kolmogorov, single-threaded
+    GC_MAXFLOW_PUSH_RELABEL = 1,    // synchronous push-relabel on all cores
+    GC_MAXFLOW_IBFS = 2,            // incremental breadth-first search, single-threaded
+};
+
+/**
+ * Color models for the data term
+ */
+enum
+{
+    GC_COLOR_GMM = 0,               // Gaussian mixture models with 5 components
+    GC_COLOR_HISTOGRAM = 1,         // 3D color histograms
+};
+
+/**
+ * Options of extendedGrabCut() that select the solver, the capacity type, the
+ * graph and the color model. The defaults give the original algorithm.
+ */
+struct GrabCutOptions
+{
+    GrabCutOptions() :
+        dynamic(true), maxflow(GC_MAXFLOW_BK), weightType(CV_64F), pyramid(1), superpixelSize(0),
+        refineSuperpixels(true), colorModel(GC_COLOR_GMM), histogramBins(16), histogramSmoothing(1),
+        initSamples(20000)
+    {
+    }
+
+    // Reuse the flow and search trees of the previous iteration for the
+    // min-cut calculation
+    bool dynamic;
+
+    // Algorithm for the min-cut calculation. All algorithms return the same
+    // cut.
+    int maxflow;
+
+    // Capacity type of the graph: CV_64F, CV_32F or CV_32S. CV_32S stores the
+    // weights as fixed-point numbers with 10 fraction bits.
+    int weightType;
+
+    // Number of levels of an image pyramid. The GMMs are learned and the
+    // iterations run on the coarsest level. On each finer level, only a band
+    // of a few pixels around the upsampled boundary is segmented again. 1
+    // segments the full image in all iterations.
+    int pyramid;
+
+    // If positive, the image is clustered into superpixels of about this side
+    // length and the graph has one vertex per superpixel. Hard constraints of
+    // the mask split the superpixels. The max-flow algorithm is not used then.
+    int superpixelSize;
+
+    // Segment the pixels around the boundary of the superpixel segmentation
+    // again
+    bool refineSuperpixels;
+
+    // Color likelihood of the data term. The model matrices hold the
+    // parameters of the GMMs or the data term of each histogram bin.
+    int colorModel;
+
+    // Bins per color channel of the histograms, at most 32
+    int histogramBins;
+
+    // Number of samples added to each histogram bin, so that colors without
+    // samples are not impossible
+    double histogramSmoothing;
+
+    // Maximum number of pixels of each GMM that are clustered with k-means
+    // for the initialization. They are spread evenly over the image, the
+    // others are assigned to the most likely cluster. 0 clusters all pixels.
+    int initSamples;
+};
+
 /**
  * Modified version of the GrabCut algorithm
  * 
+ * The graph only covers the bounding box of the GC_PR_BGD and GC_PR_FGD
+ * pixels. The saving therefore depends on the size of that box, not on the
+ * number of undecided pixels: two small brush regions in opposite corners
+ * give a graph as large as the full image.
+ *
  * @param tolerance     Take only this portion pixels in the rectangular for the
  *                      calculation of the foreground distribution that are most
  *                      unlikely in the background distribution.
@@ -33,12 +114,15 @@ enum
  * 
  * @param neighbors     Change the modeled connectivity of the graph used for the
  *                      min-cut calculation
+ *
+ * @param options       Solver, capacity type, graph and color model
  */
 void extendedGrabCut(InputArray _img, InputOutputArray _mask, Rect rect,
                      InputOutputArray _bgdModel, InputOutputArray _fgdModel,
                      int iterCount, double tolerance = 1, bool extended = false,
                      double connectivity = 1, double contrast = 1,
-                     int neighbors = GC_N8, int mode = GC_EVAL);
+                     int neighbors = GC_N8, int mode = GC_EVAL,
+                     const GrabCutOptions &options = GrabCutOptions());
 
 }
 